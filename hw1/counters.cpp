@@ -1,226 +1,2510 @@
 #include <iostream>
 #include <sstream>
 #include <vector>
+#include <queue>
 #include <memory>
 #include <atomic>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <chrono>
 #include <cctype>
 #include <algorithm>
 #include <functional>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <cstddef>
+#include <cstdint>
 #include <climits>
+#include <new>
 
-#define MSG_HELP "usage: %s n=[counter_n] freq=[freq_hz] max=[cnt_max]\n"
+#define MSG_HELP "usage: %s n=[counter_n] freq=[freq_hz] max=[cnt_max] mode=[thread|virtual|wheel] workers=[worker_n]" \
+                 " catchup=[burst|skip] spin=[spin_ns] refresh=[refresh_hz] notify=[0|1]\n" \
+                 "       cpus=[0-3,...] pin=[none|rr|packed] ui_cpu=[cpu] sched=[other|fifo[:prio]] nice=[nice]\n" \
+                 "       cap=[counter capacity] ctl=[control fifo path] shm=[/segment name]\n" \
+                 "       %s bench=[seconds] n=[counter_n,...] freq=[freq_hz,...] [mode=... workers=... catchup=... spin=...]\n"
+
+#define FREQ_HZ_MAX 10000000000ULL
+#define UI_NOTIFY_HZ 60     // Frame rate cap for notified redraws when refresh=0
 
 static void EnvSetup();
 static void EnvClear();
+static void EnvWrite(const std::string &buf);
+static void EnvGetSize(std::size_t &rows, std::size_t &cols);
 static int EnvGetChar(bool is_nonblock = false);
+static int EnvGetKey();
+static int EnvWait(long timeout_ms);     // ENV_WAKE_* bits, 0 on timeout
+static void EnvNotify();
+
+#define ENV_WAKE_INPUT 0x1
+#define ENV_WAKE_NOTIFY 0x2
+
+struct EnvUsage {
+    double user_s;
+    double sys_s;
+    long vol_switch_n;      // Voluntary context switches, 0 where unavailable
+    long invol_switch_n;
+};
+
+static void EnvGetUsage(EnvUsage &usage);
+
+// Thread placement, applied to the calling thread
+static bool EnvGetCpus(std::vector<int> &cpus);
+static bool EnvSetAffinity(const std::vector<int> &cpus);
+static bool EnvSetRealtime(int prio);
+static bool EnvSetNice(int nice);
+
+// Shared memory segment, zero filled; other processes open it read-only by name
+// A segment of that name that already exists is replaced only if is_stale() says so for a read-only view of it,
+// and the name is only removed on release while it still refers to this segment
+static void *EnvShmCreate(const std::string &name, std::size_t size,
+                          const std::function<bool (const void *, std::size_t)> &is_stale);
+static void EnvShmRelease(const std::string &name, void *ptr, std::size_t size);
+static std::uint64_t EnvGetPid();
+static bool EnvIsPidAlive(std::uint64_t pid);
+
+// Control channel, EnvCtlStop() wakes a blocked EnvCtlRead() from another thread
+static bool EnvCtlOpen(const std::string &path);
+static bool EnvCtlRead(std::string &data);
+static void EnvCtlStop();
+static void EnvCtlClose();
+
+#if defined(__unix__)
+
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+
+static int notify_pipe[2] = { -1, -1 };
+static bool is_stdin_closed = false;
+static int pending_key = -1;    // Read past a lone ESC, returned by the next EnvGetKey()
+
+static int ctl_fd = -1;
+static int ctl_stop_pipe[2] = { -1, -1 };
+static std::string ctl_path;
+
+static dev_t shm_dev = 0;       // Identity of the segment EnvShmCreate() made
+static ino_t shm_ino = 0;
+
+static void EnvSetup() {
+    termios attr;
+
+    // Self-pipe, lets other threads interrupt EnvWait()
+    if (notify_pipe[0] < 0 && pipe(notify_pipe) == 0) {
+        fcntl(notify_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(notify_pipe[1], F_SETFL, O_NONBLOCK);
+    }
+
+    if (tcgetattr(STDIN_FILENO, &attr) == -1)
+        return;
+
+    attr.c_lflag &= ~(ICANON | ECHO);
+    attr.c_cc[VTIME] = 0;
+    attr.c_cc[VMIN] = 1;
+
+    tcsetattr(STDIN_FILENO, TCSANOW, &attr);
+}
+
+static void EnvClear() {
+    EnvWrite("\033[H\033[J");
+}
+
+static void EnvWrite(const std::string &buf) {
+    std::size_t off = 0;
+
+    while (off < buf.size()) {
+        auto ret = write(STDOUT_FILENO, buf.data() + off, buf.size() - off);
+
+        if (ret < 0 && errno != EINTR)
+            return;
+
+        if (ret > 0)
+            off += ret;
+    }
+}
+
+static void EnvGetSize(std::size_t &rows, std::size_t &cols) {
+    winsize ws;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_row == 0 || ws.ws_col == 0) {
+        rows = 24;
+        cols = 80;
+        return;
+    }
+
+    rows = ws.ws_row;
+    cols = ws.ws_col;
+}
+
+static int EnvGetChar(bool is_nonblock) {
+    int len;
+    unsigned char ch;
+
+    if (ioctl(STDIN_FILENO, FIONREAD, &len) == -1)
+        return -1;
+
+    if (is_nonblock && len < 1)
+        return -1;
+
+    // Unbuffered, stdio would keep bytes that poll() can no longer see
+    return read(STDIN_FILENO, &ch, 1) == 1 ? ch : -1;
+}
+
+// Non-blocking, arrow and page keys are folded into k/j and b/f
+static int EnvGetKey() {
+    if (pending_key >= 0) {
+        auto ch = pending_key;
+        pending_key = -1;
+        return ch;
+    }
+
+    auto ch = EnvGetChar(true);
+
+    if (ch != '\033')
+        return ch;
+
+    // A key typed right after a lone ESC is not part of a sequence, keep it
+    auto next_ch = EnvGetChar(true);
+
+    if (next_ch != '[') {
+        pending_key = next_ch;
+        return ch;
+    }
+
+    switch (EnvGetChar(true)) {
+    case 'A':
+        return 'k';
+    case 'B':
+        return 'j';
+    case '5':
+        return EnvGetChar(true) == '~' ? 'b' : -1;
+    case '6':
+        return EnvGetChar(true) == '~' ? 'f' : -1;
+    default:
+        return -1;
+    }
+}
+
+static int EnvWait(long timeout_ms) {
+    // Already read, poll() would not report it
+    if (pending_key >= 0)
+        return ENV_WAKE_INPUT;
+
+    pollfd fds[2] = {
+        { notify_pipe[0], POLLIN, 0 },
+        { STDIN_FILENO, POLLIN, 0 },
+    };
+
+    if (poll(fds, is_stdin_closed ? 1 : 2, static_cast<int>(std::min<long>(timeout_ms, INT_MAX))) <= 0)
+        return 0;
+
+    int woken = 0;
+
+    if (fds[0].revents & POLLIN) {
+        char buf[64];
+
+        while (read(notify_pipe[0], buf, sizeof(buf)) > 0) {}
+
+        woken |= ENV_WAKE_NOTIFY;
+    }
+
+    if (fds[1].revents != 0) {
+        int len;
+
+        // Readable without pending bytes is EOF, stop waking up on it
+        if ((fds[1].revents & (POLLHUP | POLLERR | POLLNVAL)) || ioctl(STDIN_FILENO, FIONREAD, &len) == -1 || len < 1)
+            is_stdin_closed = true;
+
+        woken |= ENV_WAKE_INPUT;
+    }
+
+    return woken;
+}
+
+static void EnvNotify() {
+    if (notify_pipe[1] >= 0) {
+        auto ret = write(notify_pipe[1], "", 1);
+        (void)ret;
+    }
+}
+
+static void EnvGetUsage(EnvUsage &usage) {
+    rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+
+    usage.user_s = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    usage.sys_s = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    usage.vol_switch_n = ru.ru_nvcsw;
+    usage.invol_switch_n = ru.ru_nivcsw;
+}
+
+#if defined(__linux__)
+
+static bool EnvGetCpus(std::vector<int> &cpus) {
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return false;
+
+    for (int i = 0; i < CPU_SETSIZE; i++)
+        if (CPU_ISSET(i, &set))
+            cpus.push_back(i);
+
+    return true;
+}
+
+static bool EnvSetAffinity(const std::vector<int> &cpus) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+
+    for (auto cpu : cpus)
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+
+    return CPU_COUNT(&set) > 0 && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+#else
+
+static bool EnvGetCpus(std::vector<int> &cpus) {
+    (void)cpus;
+    return false;
+}
+
+static bool EnvSetAffinity(const std::vector<int> &cpus) {
+    (void)cpus;
+    return false;
+}
+
+#endif
+
+static bool EnvSetRealtime(int prio) {
+    sched_param param;
+
+    param.sched_priority = std::min(std::max(prio, sched_get_priority_min(SCHED_FIFO)), sched_get_priority_max(SCHED_FIFO));
+
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+}
+
+static bool EnvSetNice(int nice) {
+    // Linux keeps the nice value per thread, elsewhere this renices the whole process
+    return setpriority(PRIO_PROCESS, 0, nice) == 0;
+}
+
+// Whether name currently refers to the object dev/ino
+static bool EnvShmIsSame(const std::string &name, dev_t dev, ino_t ino) {
+    struct stat st;
+    auto fd = shm_open(name.c_str(), O_RDONLY, 0);
+
+    if (fd < 0)
+        return false;
+
+    auto is_same = fstat(fd, &st) == 0 && st.st_dev == dev && st.st_ino == ino;
+    close(fd);
+
+    return is_same;
+}
+
+// Unlinks an existing segment if is_stale() agrees, readers still mapping it keep their view
+static bool EnvShmUnlinkStale(const std::string &name, const std::function<bool (const void *, std::size_t)> &is_stale) {
+    struct stat st;
+    auto fd = shm_open(name.c_str(), O_RDONLY, 0);
+
+    if (fd < 0)
+        return errno == ENOENT;
+
+    auto is_unlink = false;
+
+    if (fstat(fd, &st) == 0) {
+        auto size = static_cast<std::size_t>(st.st_size);
+        auto ptr = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+
+        if (ptr != MAP_FAILED) {
+            is_unlink = is_stale(ptr, size);
+            munmap(ptr, size);
+        }
+    }
+
+    close(fd);
+
+    // Another process may have replaced it meanwhile, that one is not ours to remove
+    if (!is_unlink || !EnvShmIsSame(name, st.st_dev, st.st_ino))
+        return false;
+
+    return shm_unlink(name.c_str()) == 0 || errno == ENOENT;
+}
+
+static void *EnvShmCreate(const std::string &name, std::size_t size,
+                          const std::function<bool (const void *, std::size_t)> &is_stale) {
+    struct stat st;
+    auto fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    void *ptr = MAP_FAILED;
+
+    if (fd < 0 && errno == EEXIST && EnvShmUnlinkStale(name, is_stale))
+        fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+
+    if (fd < 0)
+        return nullptr;
+
+    if (fstat(fd, &st) == 0 && ftruncate(fd, size) == 0) {
+        shm_dev = st.st_dev;
+        shm_ino = st.st_ino;
+        ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    close(fd);
+
+    if (ptr == MAP_FAILED) {
+        if (EnvShmIsSame(name, st.st_dev, st.st_ino))
+            shm_unlink(name.c_str());
+
+        return nullptr;
+    }
+
+    return ptr;
+}
+
+static void EnvShmRelease(const std::string &name, void *ptr, std::size_t size) {
+    munmap(ptr, size);
+
+    if (EnvShmIsSame(name, shm_dev, shm_ino))
+        shm_unlink(name.c_str());
+}
+
+static std::uint64_t EnvGetPid() {
+    return static_cast<std::uint64_t>(getpid());
+}
+
+static bool EnvIsPidAlive(std::uint64_t pid) {
+    return kill(static_cast<pid_t>(pid), 0) == 0 || errno == EPERM;
+}
+
+static bool EnvCtlOpen(const std::string &path) {
+    struct stat st;
+    auto is_created = mkfifo(path.c_str(), 0600) == 0;
+
+    if (!is_created && (errno != EEXIST || stat(path.c_str(), &st) != 0 || !S_ISFIFO(st.st_mode)))
+        return false;
+
+    // Held open for writing as well, so the FIFO never reports EOF between two writers
+    ctl_fd = open(path.c_str(), O_RDWR | O_NONBLOCK);
+
+    if (ctl_fd < 0 || pipe(ctl_stop_pipe) != 0) {
+        EnvCtlClose();
+
+        if (is_created)
+            unlink(path.c_str());
+
+        return false;
+    }
+
+    ctl_path = is_created ? path : "";
+
+    return true;
+}
+
+static bool EnvCtlRead(std::string &data) {
+    pollfd fds[2] = { { ctl_fd, POLLIN, 0 }, { ctl_stop_pipe[0], POLLIN, 0 } };
+    char buf[4096];
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            return false;
+
+        if (fds[1].revents != 0)
+            return false;
+
+        auto len = read(ctl_fd, buf, sizeof(buf));
+
+        if (len > 0) {
+            data.append(buf, len);
+            return true;
+        }
+
+        if (len < 0 && errno != EAGAIN && errno != EINTR)
+            return false;
+    }
+}
+
+static void EnvCtlStop() {
+    if (ctl_stop_pipe[1] >= 0) {
+        auto ret = write(ctl_stop_pipe[1], "", 1);
+        (void)ret;
+    }
+}
+
+static void EnvCtlClose() {
+    for (auto fd : { ctl_fd, ctl_stop_pipe[0], ctl_stop_pipe[1] })
+        if (fd >= 0)
+            close(fd);
+
+    ctl_fd = ctl_stop_pipe[0] = ctl_stop_pipe[1] = -1;
+
+    // A FIFO that existed before is left in place
+    if (!ctl_path.empty())
+        unlink(ctl_path.c_str());
+
+    ctl_path.clear();
+}
+
+#elif defined(_WIN32)
+
+#include <windows.h>
+#include <conio.h>
+#include <intrin.h>
+
+static HANDLE notify_event = nullptr;
+
+static HANDLE ctl_pipe = INVALID_HANDLE_VALUE;
+static HANDLE ctl_io_event = nullptr;
+static HANDLE ctl_stop_event = nullptr;
+static bool is_ctl_connected = false;
+
+static HANDLE shm_mapping = nullptr;
+
+static void EnvSetup() {
+    auto hdl = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD console_mode;
+
+    if (notify_event == nullptr)
+        notify_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+
+    // Frames are drawn with VT cursor addressing
+    if (GetConsoleMode(hdl, &console_mode))
+        SetConsoleMode(hdl, console_mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+}
+
+static void EnvClear() {
+    auto hdl = GetStdHandle(STD_OUTPUT_HANDLE);
+
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    GetConsoleScreenBufferInfo(hdl, &csbi);
+
+    COORD coord = { 0, 0 };
+    DWORD cellCount = csbi.dwSize.X * csbi.dwSize.Y;
+    DWORD rowCount;
+
+    FillConsoleOutputCharacter(hdl, ' ', cellCount, coord, &rowCount);
+    FillConsoleOutputAttribute(hdl, csbi.wAttributes, cellCount, coord, &rowCount);
+    SetConsoleCursorPosition(hdl, coord);
+}
+
+static void EnvWrite(const std::string &buf) {
+    DWORD written;
+
+    WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), buf.data(), static_cast<DWORD>(buf.size()), &written, nullptr);
+}
+
+static void EnvGetSize(std::size_t &rows, std::size_t &cols) {
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+
+    if (!GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi)) {
+        rows = 24;
+        cols = 80;
+        return;
+    }
+
+    rows = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+    cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+}
+
+static int EnvGetChar(bool is_nonblock) {
+    if (is_nonblock && !_kbhit())
+        return -1;
+
+    return _getch();
+}
+
+// Non-blocking, arrow and page keys are folded into k/j and b/f
+static int EnvGetKey() {
+    auto ch = EnvGetChar(true);
+
+    if (ch != 0 && ch != 0xe0)
+        return ch;
+
+    switch (_getch()) {
+    case 'H':
+        return 'k';
+    case 'P':
+        return 'j';
+    case 'I':
+        return 'b';
+    case 'Q':
+        return 'f';
+    default:
+        return -1;
+    }
+}
+
+static int EnvWait(long timeout_ms) {
+    HANDLE hdls[2] = { notify_event, GetStdHandle(STD_INPUT_HANDLE) };
+
+    switch (WaitForMultipleObjects(2, hdls, FALSE, timeout_ms < 0 ? INFINITE : static_cast<DWORD>(timeout_ms))) {
+    case WAIT_OBJECT_0:
+        return ENV_WAKE_NOTIFY;
+    case WAIT_OBJECT_0 + 1:
+        return ENV_WAKE_INPUT;
+    default:
+        return 0;
+    }
+}
+
+static void EnvNotify() {
+    if (notify_event != nullptr)
+        SetEvent(notify_event);
+}
+
+static void EnvGetUsage(EnvUsage &usage) {
+    FILETIME create_time, exit_time, kernel_time, user_time;
+
+    GetProcessTimes(GetCurrentProcess(), &create_time, &exit_time, &kernel_time, &user_time);
+
+    // FILETIME counts 100 ns units
+    usage.user_s = ((static_cast<std::uint64_t>(user_time.dwHighDateTime) << 32) | user_time.dwLowDateTime) / 1e7;
+    usage.sys_s = ((static_cast<std::uint64_t>(kernel_time.dwHighDateTime) << 32) | kernel_time.dwLowDateTime) / 1e7;
+    usage.vol_switch_n = 0;
+    usage.invol_switch_n = 0;
+}
+
+static bool EnvGetCpus(std::vector<int> &cpus) {
+    DWORD_PTR process_mask, system_mask;
+
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+        return false;
+
+    for (int i = 0; i < static_cast<int>(sizeof(process_mask) * 8); i++)
+        if (process_mask & (static_cast<DWORD_PTR>(1) << i))
+            cpus.push_back(i);
+
+    return true;
+}
+
+static bool EnvSetAffinity(const std::vector<int> &cpus) {
+    DWORD_PTR mask = 0;
+
+    // Only the first processor group is addressable here
+    for (auto cpu : cpus)
+        if (cpu >= 0 && cpu < static_cast<int>(sizeof(mask) * 8))
+            mask |= static_cast<DWORD_PTR>(1) << cpu;
+
+    return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+}
+
+static bool EnvSetRealtime(int prio) {
+    (void)prio;
+    return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) != 0;
+}
+
+static bool EnvSetNice(int nice) {
+    int prio = nice <= -10 ? THREAD_PRIORITY_HIGHEST
+             : nice < 0 ? THREAD_PRIORITY_ABOVE_NORMAL
+             : nice == 0 ? THREAD_PRIORITY_NORMAL
+             : nice < 10 ? THREAD_PRIORITY_BELOW_NORMAL
+             : THREAD_PRIORITY_LOWEST;
+
+    return SetThreadPriority(GetCurrentThread(), prio) != 0;
+}
+
+// name is a mapping name, e.g. Local\\counters
+// Mappings vanish with their last handle, so one that exists is still in use and cannot be replaced
+static void *EnvShmCreate(const std::string &name, std::size_t size,
+                          const std::function<bool (const void *, std::size_t)> &is_stale) {
+    (void)is_stale;
+
+    shm_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+                                     static_cast<DWORD>(static_cast<std::uint64_t>(size) >> 32),
+                                     static_cast<DWORD>(size), name.c_str());
+
+    if (shm_mapping == nullptr)
+        return nullptr;
+
+    if (GetLastError() == ERROR_ALREADY_EXISTS) {
+        CloseHandle(shm_mapping);
+        shm_mapping = nullptr;
+        return nullptr;
+    }
+
+    auto ptr = MapViewOfFile(shm_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+
+    if (ptr == nullptr) {
+        CloseHandle(shm_mapping);
+        shm_mapping = nullptr;
+    }
+
+    return ptr;
+}
+
+static void EnvShmRelease(const std::string &name, void *ptr, std::size_t size) {
+    (void)name;
+    (void)size;
+
+    UnmapViewOfFile(ptr);
+    CloseHandle(shm_mapping);
+    shm_mapping = nullptr;
+}
+
+static std::uint64_t EnvGetPid() {
+    return GetCurrentProcessId();
+}
+
+static bool EnvIsPidAlive(std::uint64_t pid) {
+    auto process = OpenProcess(SYNCHRONIZE, FALSE, static_cast<DWORD>(pid));
+
+    if (process == nullptr)
+        return GetLastError() == ERROR_ACCESS_DENIED;
+
+    auto is_alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+    CloseHandle(process);
+
+    return is_alive;
+}
+
+// path is a pipe name, e.g. \\.\pipe\counters
+static bool EnvCtlOpen(const std::string &path) {
+    ctl_pipe = CreateNamedPipeA(path.c_str(), PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED, PIPE_TYPE_BYTE | PIPE_WAIT,
+                                1, 0, 4096, 0, nullptr);
+
+    if (ctl_pipe == INVALID_HANDLE_VALUE)
+        return false;
+
+    ctl_io_event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    ctl_stop_event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+
+    return true;
+}
+
+static bool EnvCtlRead(std::string &data) {
+    char buf[4096];
+
+    // Serves one writer at a time, reconnecting when it goes away
+    while (true) {
+        OVERLAPPED ov = {};
+        DWORD len = 0;
+        BOOL is_done;
+
+        ov.hEvent = ctl_io_event;
+
+        if (!is_ctl_connected)
+            is_done = ConnectNamedPipe(ctl_pipe, &ov) || GetLastError() == ERROR_PIPE_CONNECTED;
+        else
+            is_done = ReadFile(ctl_pipe, buf, sizeof(buf), &len, &ov);
+
+        if (!is_done && GetLastError() == ERROR_IO_PENDING) {
+            HANDLE handles[2] = { ctl_io_event, ctl_stop_event };
+
+            if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0) {
+                CancelIo(ctl_pipe);
+                GetOverlappedResult(ctl_pipe, &ov, &len, TRUE);
+                return false;
+            }
+
+            is_done = GetOverlappedResult(ctl_pipe, &ov, &len, FALSE);
+        }
+
+        if (!is_ctl_connected) {
+            if (!is_done)
+                return false;
+
+            is_ctl_connected = true;
+        } else if (is_done && len > 0) {
+            data.append(buf, len);
+            return true;
+        } else if (!is_done) {
+            DisconnectNamedPipe(ctl_pipe);
+            is_ctl_connected = false;
+        }
+    }
+}
+
+static void EnvCtlStop() {
+    if (ctl_stop_event != nullptr)
+        SetEvent(ctl_stop_event);
+}
+
+static void EnvCtlClose() {
+    for (auto hdl : { ctl_pipe, ctl_io_event, ctl_stop_event })
+        if (hdl != nullptr && hdl != INVALID_HANDLE_VALUE)
+            CloseHandle(hdl);
+
+    ctl_pipe = INVALID_HANDLE_VALUE;
+    ctl_io_event = ctl_stop_event = nullptr;
+    is_ctl_connected = false;
+}
+
+#endif
+
+template <typename T>
+static void TrimTextL(T &s) {
+    s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](auto ch) {
+        return !std::isspace(ch);
+    }));
+}
+
+template <typename T>
+static void TrimTextR(T &s) {
+    s.erase(std::find_if(s.rbegin(), s.rend(), [](auto ch) {
+        return !std::isspace(ch);
+    }).base(), s.end());
+}
+
+template <typename T>
+static void TrimText(T &s) {
+    TrimTextL(s);
+    TrimTextR(s);
+}
+
+// "0-3,6" -> { 0, 1, 2, 3, 6 }
+static bool ParseCpuList(const std::string &s, std::vector<int> &cpus) {
+    std::istringstream ss(s);
+    std::string part;
+
+    while (std::getline(ss, part, ',')) {
+        char *end;
+        auto first = std::strtol(part.c_str(), &end, 10);
+        auto last = first;
+
+        if (*end == '-')
+            last = std::strtol(end + 1, &end, 10);
+
+        if (end == part.c_str() || *end != '\0' || first < 0 || last < first || last >= 4096)
+            return false;
+
+        for (auto cpu = first; cpu <= last; cpu++)
+            cpus.push_back(static_cast<int>(cpu));
+    }
+
+    return !cpus.empty();
+}
+
+// "1,10,100" -> { 1, 10, 100 }, 0 for entries that are not numbers
+static std::vector<std::uint64_t> ParseList(const std::string &s) {
+    std::vector<std::uint64_t> list;
+    std::istringstream ss(s);
+    std::string part;
+
+    while (std::getline(ss, part, ','))
+        list.push_back(std::strtoull(part.c_str(), nullptr, 0));
+
+    return list;
+}
+
+// floor(a * b / c), exact while b * c fits in 64 bits
+static std::uint64_t MulDiv(std::uint64_t a, std::uint64_t b, std::uint64_t c) {
+    return a / c * b + a % c * b / c;
+}
+
+enum class CounterMode {
+    Thread,     // one ticking thread per counter
+    Virtual,    // no thread, value derived from the clock on read
+    Wheel,      // ticked by a fixed pool of timer wheel workers
+};
+
+// Behaviour when a counter wakes up more than one period late
+enum class CatchUp {
+    Burst,      // count every missed tick at once
+    Skip,       // count one tick and resume at the next deadline
+};
+
+// How counter threads (thread mode) or scheduler workers (wheel mode) are spread over cpus
+enum class PinMode {
+    None,       // float over all of ThreadPlacement::cpus
+    RoundRobin, // thread i on cpus[i % cpus.size()]
+    Packed,     // neighbouring threads, which tick neighbouring counters, share a cpu
+};
+
+#define PLACEMENT_AFFINITY_FAILED 0x1
+#define PLACEMENT_REALTIME_FAILED 0x2
+#define PLACEMENT_NICE_FAILED 0x4
+
+static std::atomic<unsigned> placement_failed(0);
+
+struct ThreadPlacement {
+    std::vector<int> cpus;      // Empty: leave affinity alone
+    PinMode pin = PinMode::None;
+    bool is_realtime = false;   // SCHED_FIFO
+    int realtime_prio = 1;
+    bool is_nice = false;
+    int nice = 0;
+    std::size_t thread_n = 1;   // Packed: threads to spread over cpus, set by their owner
+
+    // Called by the thread itself; anything not permitted is reported once on stderr and skipped
+    void apply(std::size_t thread_idx) const {
+        if (!cpus.empty()) {
+            std::vector<int> set;
+
+            if (pin == PinMode::RoundRobin)
+                set.push_back(cpus[thread_idx % cpus.size()]);
+            else if (pin == PinMode::Packed)
+                set.push_back(cpus[MulDiv(thread_idx % thread_n, cpus.size(), thread_n)]);
+            else
+                set = cpus;
+
+            if (!EnvSetAffinity(set))
+                report(PLACEMENT_AFFINITY_FAILED, "cannot set cpu affinity, counters float over all cpus");
+        }
+
+        if (is_realtime && !EnvSetRealtime(realtime_prio))
+            report(PLACEMENT_REALTIME_FAILED, "SCHED_FIFO not permitted, counters keep the default policy");
+
+        if (is_nice && !EnvSetNice(nice))
+            report(PLACEMENT_NICE_FAILED, "nice level not permitted, counters keep the default priority");
+    }
+
+private:
+    static void report(unsigned flag, const char *msg) {
+        if ((placement_failed.fetch_or(flag, std::memory_order_relaxed) & flag) == 0)
+            std::fprintf(stderr, "warning: %s\n", msg);
+    }
+};
+
+struct CounterOptions {
+    CounterMode mode = CounterMode::Thread;
+    bool is_notify = false;         // Wake the UI whenever a counter ticks
+    bool is_stats = false;          // Collect TickStats for benchmarks
+    CatchUp catch_up = CatchUp::Burst;
+    std::uint64_t spin_ns = 0;      // Thread: busy-wait this long before each deadline
+    std::size_t worker_n = 1;       // Wheel: scheduler threads
+    ThreadPlacement placement;
+    std::string shm_name;           // Publish CounterState as this shared memory segment
+};
+
+#define WHEEL_RES_SHIFT 14     // 16.384 us per wheel tick
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOT_N (1 << WHEEL_SLOT_BITS)
+#define WHEEL_LEVEL_N 4
+
+#define THREAD_WAKE_MIN_NS 1000000     // Shorter thread-mode sleeps just run out instead of being woken
+
+static std::uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void CpuRelax() {
+#if defined(_MSC_VER)
+    YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Sleeps until spin_ns before the deadline, then spins past it
+// OS sleeps overshoot by tens of microseconds, which is a whole period at high frequencies
+static void SleepUntilNs(std::uint64_t due_ns, std::uint64_t spin_ns) {
+    if (due_ns > NowNs() + spin_ns)
+        std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::nanoseconds(due_ns - spin_ns)));
+
+    while (NowNs() < due_ns)
+        CpuRelax();
+}
+
+static int CountTrailingZeros(std::uint64_t v) {
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanForward64(&idx, v);
+    return static_cast<int>(idx);
+#else
+    return __builtin_ctzll(v);
+#endif
+}
+
+static int CountLeadingZeros(std::uint64_t v) {
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanReverse64(&idx, v);
+    return 63 - static_cast<int>(idx);
+#else
+    return __builtin_clzll(v);
+#endif
+}
+
+// Collapses any number of change notifications into one EnvNotify() until the UI consumes it
+class ChangeNotifier {
+public:
+    void notify() {
+        if (!is_pending.load(std::memory_order_relaxed) && !is_pending.exchange(true, std::memory_order_acq_rel))
+            EnvNotify();
+    }
+
+    void consume() {
+        is_pending.store(false, std::memory_order_release);
+    }
+
+private:
+    std::atomic<bool> is_pending{false};
+};
+
+#define STATS_LINEAR_N 16
+#define STATS_SUB_BITS 2
+#define STATS_BUCKET_N (STATS_LINEAR_N + (64 - 4) * (1 << STATS_SUB_BITS))
+
+// Log-linear histogram of tick lateness, 4 buckets per power of two
+// Written by a single ticking thread, fields are atomics only so other threads may read them meanwhile
+class TickStats {
+public:
+    void record(std::uint64_t late_ns, std::uint64_t tick_add) {
+        add(bucket_n[bucket_of(late_ns)], 1);
+        add(wake_n, 1);
+        add(tick_n, tick_add);
+
+        if (late_ns > max_ns.load(std::memory_order_relaxed))
+            max_ns.store(late_ns, std::memory_order_relaxed);
+    }
+
+    void merge(const TickStats &other) {
+        for (int i = 0; i < STATS_BUCKET_N; i++)
+            add(bucket_n[i], other.bucket_n[i].load(std::memory_order_relaxed));
+
+        add(wake_n, other.wake_n.load(std::memory_order_relaxed));
+        add(tick_n, other.tick_n.load(std::memory_order_relaxed));
+        max_ns.store(std::max(max_ns.load(std::memory_order_relaxed), other.max_ns.load(std::memory_order_relaxed)),
+                     std::memory_order_relaxed);
+    }
+
+    std::uint64_t get_wake_count() const {
+        return wake_n.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t get_tick_count() const {
+        return tick_n.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t get_max_ns() const {
+        return max_ns.load(std::memory_order_relaxed);
+    }
+
+    // Upper bound of the bucket holding the p-quantile
+    std::uint64_t percentile_ns(double p) const {
+        auto total = get_wake_count();
+        std::uint64_t seen = 0;
+
+        if (total == 0)
+            return 0;
+
+        for (int i = 0; i < STATS_BUCKET_N; i++) {
+            seen += bucket_n[i].load(std::memory_order_relaxed);
+
+            if (seen >= p * total)
+                return std::min(bucket_max(i), get_max_ns());
+        }
+
+        return get_max_ns();
+    }
+
+private:
+    static void add(std::atomic<std::uint64_t> &v, std::uint64_t n) {
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static int bucket_of(std::uint64_t v) {
+        if (v < STATS_LINEAR_N)
+            return static_cast<int>(v);
+
+        auto msb = 63 - CountLeadingZeros(v);
+        auto sub = static_cast<int>((v >> (msb - STATS_SUB_BITS)) & ((1 << STATS_SUB_BITS) - 1));
+
+        return STATS_LINEAR_N + (msb - 4) * (1 << STATS_SUB_BITS) + sub;
+    }
+
+    static std::uint64_t bucket_max(int idx) {
+        if (idx < STATS_LINEAR_N)
+            return idx;
+
+        auto msb = (idx - STATS_LINEAR_N) / (1 << STATS_SUB_BITS) + 4;
+        auto sub = static_cast<std::uint64_t>((idx - STATS_LINEAR_N) % (1 << STATS_SUB_BITS));
+        auto width = std::uint64_t(1) << (msb - STATS_SUB_BITS);
+
+        return (std::uint64_t(1) << msb) + (sub + 1) * width - 1;
+    }
+
+    std::atomic<std::uint64_t> bucket_n[STATS_BUCKET_N] = {};
+    std::atomic<std::uint64_t> wake_n{0};
+    std::atomic<std::uint64_t> tick_n{0};
+    std::atomic<std::uint64_t> max_ns{0};
+};
+
+// Tick schedule of one counter, only touched by the thread or worker ticking it
+struct TimerEntry {
+    TimerEntry *prev = nullptr;
+    TimerEntry *next = nullptr;
+    int slot = -1;      // level * WHEEL_SLOT_N + index, -1 while disarmed
+
+    std::atomic_int *cnt = nullptr;
+    const std::atomic<std::uint64_t> *freq_src = nullptr;     // Copied into freq_hz by arm()
+    const std::atomic_int *max_src = nullptr;                 // Read on every add(), retune() does not wait for a rearm
+    std::uint64_t freq_hz = 1;
+    CatchUp catch_up = CatchUp::Burst;
+    ChangeNotifier *notifier = nullptr;
+    TickStats *stats = nullptr;
+
+    // Tick k is due at resume_ns + k / freq_hz seconds, kept as due_ns + due_rem / freq_hz
+    std::uint64_t resume_ns = 0;
+    std::uint64_t tick_n = 0;
+    std::uint64_t due_ns = 0;
+    std::uint64_t due_rem = 0;
+
+    void arm(std::uint64_t now_ns) {
+        freq_hz = freq_src->load(std::memory_order_relaxed);
+
+        add(0);
+
+        resume_ns = now_ns;
+        tick_n = 0;
+        due_ns = now_ns;
+        due_rem = 0;
+
+        advance();
+    }
+
+    // Returns false if the entry was not due yet
+    bool fire(std::uint64_t now_ns) {
+        if (due_ns > now_ns)
+            return false;
+
+        auto late_ns = now_ns - due_ns;
+        std::uint64_t tick_add = 1;
+
+        tick_n++;
+        advance();
+
+        if (due_ns <= now_ns) {
+            // Fell behind by more than one period, the next deadline is the first one in the future
+            auto due_n = MulDiv(now_ns - resume_ns, freq_hz, 1000000000);
+
+            if (catch_up == CatchUp::Burst)
+                tick_add += due_n - tick_n;
+
+            tick_n = due_n;
+
+            auto due_nsec = (tick_n + 1) * 1000000000;
+            auto due_off = MulDiv(tick_n + 1, 1000000000, freq_hz);
+
+            due_ns = resume_ns + due_off;
+            due_rem = due_nsec - due_off * freq_hz;     // exact modulo 2^64
+        }
+
+        add(tick_add);
+
+        if (notifier != nullptr)
+            notifier->notify();
+
+        if (stats != nullptr)
+            stats->record(late_ns, tick_add);
+
+        return true;
+    }
+
+private:
+    // Other threads may reset the count meanwhile, so this is a CAS rather than a plain store
+    // retune() clamps the count once, right after storing the new max: a max that changed under the CAS
+    // is only seen here after that clamp may have run, so the count is wrapped again with the new one
+    void add(std::uint64_t tick_add) {
+        auto cnt_now = cnt->load(std::memory_order_relaxed);
+
+        while (true) {
+            auto cnt_mod = static_cast<std::uint64_t>(max_src->load()) + 1;
+            auto cnt_new = static_cast<int>((cnt_now + tick_add % cnt_mod) % cnt_mod);
+
+            if (!cnt->compare_exchange_weak(cnt_now, cnt_new))
+                continue;
+
+            if (static_cast<std::uint64_t>(max_src->load()) + 1 == cnt_mod)
+                return;
+
+            cnt_now = cnt_new;
+            tick_add = 0;
+        }
+    }
+
+    void advance() {
+        due_ns += 1000000000 / freq_hz;
+        due_rem += 1000000000 % freq_hz;
+
+        if (due_rem >= freq_hz) {
+            due_rem -= freq_hz;
+            due_ns++;
+        }
+    }
+};
+
+// Hierarchical timing wheel, WHEEL_LEVEL_N levels of WHEEL_SLOT_N slots each
+class TimerWheel {
+public:
+    TimerWheel(std::uint64_t now_ns):
+        cur_tick(now_ns >> WHEEL_RES_SHIFT) {}
+
+    TimerWheel(const TimerWheel &) = delete;
+    void operator=(const TimerWheel &) = delete;
+
+    bool is_empty() const {
+        for (auto m : slot_mask)
+            if (m != 0)
+                return false;
+
+        return true;
+    }
+
+    void insert(TimerEntry *e, std::uint64_t min_tick) {
+        auto tick = std::max(e->due_ns >> WHEEL_RES_SHIFT, min_tick);
+        auto delta = tick - cur_tick;
+        int level = 0;
+
+        while (level < WHEEL_LEVEL_N - 1 && delta >= (std::uint64_t(1) << (WHEEL_SLOT_BITS * (level + 1))))
+            level++;
+
+        // Beyond the top level, park in its farthest slot and cascade again from there
+        if (delta >= (std::uint64_t(1) << (WHEEL_SLOT_BITS * WHEEL_LEVEL_N)))
+            tick = cur_tick + (std::uint64_t(1) << (WHEEL_SLOT_BITS * WHEEL_LEVEL_N)) - 1;
+
+        auto idx = static_cast<int>((tick >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOT_N - 1));
+        auto &head = slots[level][idx];
+
+        e->slot = level * WHEEL_SLOT_N + idx;
+        e->prev = nullptr;
+        e->next = head;
+
+        if (head != nullptr)
+            head->prev = e;
+
+        head = e;
+        slot_mask[level] |= std::uint64_t(1) << idx;
+    }
+
+    void remove(TimerEntry *e) {
+        if (e->slot < 0)
+            return;
+
+        auto level = e->slot / WHEEL_SLOT_N;
+        auto idx = e->slot % WHEEL_SLOT_N;
+
+        if (e->prev != nullptr)
+            e->prev->next = e->next;
+        else
+            slots[level][idx] = e->next;
+
+        if (e->next != nullptr)
+            e->next->prev = e->prev;
+
+        if (slots[level][idx] == nullptr)
+            slot_mask[level] &= ~(std::uint64_t(1) << idx);
+
+        e->prev = e->next = nullptr;
+        e->slot = -1;
+    }
+
+    // Earliest wheel tick at which a slot has to be fired or cascaded, UINT64_MAX if idle
+    std::uint64_t next_tick() const {
+        auto next = UINT64_MAX;
+
+        for (int level = 0; level < WHEEL_LEVEL_N; level++) {
+            auto mask = slot_mask[level];
+
+            if (mask == 0)
+                continue;
+
+            auto shift = WHEEL_SLOT_BITS * level;
+            auto unit = (cur_tick >> shift) + 1;
+            auto rot = static_cast<int>(unit & (WHEEL_SLOT_N - 1));
+
+            if (rot != 0)
+                mask = (mask >> rot) | (mask << (WHEEL_SLOT_N - rot));
+
+            next = std::min(next, (unit + CountTrailingZeros(mask)) << shift);
+        }
+
+        return next;
+    }
+
+    std::uint64_t next_ns() const {
+        auto tick = next_tick();
+
+        return tick == UINT64_MAX ? UINT64_MAX : tick << WHEEL_RES_SHIFT;
+    }
+
+    // Fires every entry due up to now_ns
+    void run(std::uint64_t now_ns) {
+        auto now_tick = now_ns >> WHEEL_RES_SHIFT;
+
+        while (cur_tick < now_tick) {
+            auto tick = next_tick();
+
+            // Nothing to fire or cascade in between, skip ahead
+            if (tick > now_tick) {
+                cur_tick = now_tick;
+                break;
+            }
+
+            cur_tick = tick;
+
+            for (int level = 1; level < WHEEL_LEVEL_N; level++) {
+                auto shift = WHEEL_SLOT_BITS * level;
+
+                if ((cur_tick & ((std::uint64_t(1) << shift) - 1)) != 0)
+                    break;
+
+                auto e = detach(level, static_cast<int>((cur_tick >> shift) & (WHEEL_SLOT_N - 1)));
+
+                while (e != nullptr) {
+                    auto next = e->next;
+                    insert(e, cur_tick);
+                    e = next;
+                }
+            }
+
+            auto e = detach(0, static_cast<int>(cur_tick & (WHEEL_SLOT_N - 1)));
+
+            while (e != nullptr) {
+                auto next = e->next;
+                e->fire(now_ns);
+                insert(e, cur_tick + 1);
+                e = next;
+            }
+        }
+    }
+
+private:
+    TimerEntry *detach(int level, int idx) {
+        auto head = slots[level][idx];
+
+        slots[level][idx] = nullptr;
+        slot_mask[level] &= ~(std::uint64_t(1) << idx);
+
+        for (auto e = head; e != nullptr; e = e->next)
+            e->slot = -1;
+
+        return head;
+    }
+
+    TimerEntry *slots[WHEEL_LEVEL_N][WHEEL_SLOT_N] = {};
+    std::uint64_t slot_mask[WHEEL_LEVEL_N] = {};
+    std::uint64_t cur_tick;
+};
+
+// Fixed pool of worker threads, each driving the counters bound to it from its own wheel
+class CounterScheduler {
+public:
+    CounterScheduler(const CounterOptions &opts_):
+        is_stats(opts_.is_stats), placement(opts_.placement) {
+        placement.thread_n = opts_.worker_n;
+        worker_vec.reserve(opts_.worker_n);
+
+        for (std::size_t i = 0; i < opts_.worker_n; i++)
+            worker_vec.emplace_back(std::make_unique<Worker>());
+
+        for (std::size_t i = 0; i < worker_vec.size(); i++)
+            worker_vec[i]->th = std::thread([this, i]() { thread_task(i); });
+    }
+
+    ~CounterScheduler() {
+        for (auto &worker : worker_vec) {
+            {
+                std::lock_guard<std::mutex> lock(worker->mutex);
+                worker->is_stop = true;
+            }
+
+            worker->cv.notify_one();
+            worker->th.join();
+        }
+    }
+
+    CounterScheduler(const CounterScheduler &) = delete;
+    void operator=(const CounterScheduler &) = delete;
+
+    std::size_t get_worker_count() const {
+        return worker_vec.size();
+    }
+
+    void collect_stats(TickStats &out) const {
+        for (auto &worker : worker_vec)
+            out.merge(worker->stats);
+    }
+
+    // Arms (restarting its schedule from now) or disarms an entry on its worker
+    // Returns a ticket for wait()
+    std::uint64_t post(std::size_t worker_idx, TimerEntry *e, bool is_arm) {
+        auto &worker = *worker_vec.at(worker_idx);
+        std::uint64_t ticket;
+
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.inbox.emplace_back(e, is_arm);
+            ticket = ++worker.post_n;
+        }
+
+        worker.cv.notify_one();
+
+        return ticket;
+    }
+
+    // Blocks until the worker has applied the post with this ticket and everything before it
+    void wait(std::size_t worker_idx, std::uint64_t ticket) {
+        auto &worker = *worker_vec.at(worker_idx);
+        std::unique_lock<std::mutex> lock(worker.mutex);
+
+        worker.done_cv.wait(lock, [&]() { return worker.done_n >= ticket; });
+    }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<std::pair<TimerEntry *, bool>> inbox;
+        std::uint64_t post_n = 0;
+        std::uint64_t done_n = 0;
+        std::condition_variable done_cv;
+        bool is_stop = false;
+        std::thread th;
+        TickStats stats;
+    };
+
+    void thread_task(std::size_t worker_idx) {
+        auto &worker = *worker_vec[worker_idx];
+
+        placement.apply(worker_idx);
+
+        TimerWheel wheel(NowNs());
+        std::vector<std::pair<TimerEntry *, bool>> pending;
+        std::unique_lock<std::mutex> lock(worker.mutex);
+
+        while (!worker.is_stop) {
+            auto batch_n = worker.post_n;
+
+            pending.swap(worker.inbox);
+            lock.unlock();
+
+            auto now_ns = NowNs();
+
+            for (auto &msg : pending) {
+                wheel.remove(msg.first);
+
+                if (msg.second) {
+                    msg.first->stats = is_stats ? &worker.stats : nullptr;
+                    msg.first->arm(now_ns);
+                    wheel.insert(msg.first, 0);
+                }
+            }
+
+            pending.clear();
+            wheel.run(now_ns);
+
+            lock.lock();
+
+            if (worker.done_n != batch_n) {
+                worker.done_n = batch_n;
+                worker.done_cv.notify_all();
+            }
+
+            if (worker.is_stop || !worker.inbox.empty())
+                continue;
+
+            auto next_ns = wheel.next_ns();
+
+            if (next_ns == UINT64_MAX)
+                worker.cv.wait(lock);
+            else
+                worker.cv.wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::nanoseconds(next_ns)));
+        }
+    }
+
+    bool is_stats;
+    ThreadPlacement placement;
+    std::vector<std::unique_ptr<Worker>> worker_vec;
+};
+
+#define CACHE_LINE 64
+
+#define COUNTER_PAUSE 0x1
+#define COUNTER_STOP 0x2
+#define COUNTER_FREE 0x4      // Slot holds no counter
+#define COUNTER_REARM 0x8     // Thread mode: freq or max changed, restart the schedule
+
+struct CounterSample {
+    int cnt;
+    bool is_paused;
+    bool is_free;
+};
+
+#define SHM_MAGIC 0x31544e43u     // "CNT1"
+#define SHM_VERSION 2
+
+// Start of the block holding a CounterState, which is shared memory other processes may map with shm=
+//
+// Layout: this header, then one array per field, every offset a multiple of CACHE_LINE:
+//   int32 cnt[capacity]        thread, wheel: the value, updated in place by the ticking thread
+//                              virtual: the value at resume_ns, or the value while paused
+//                              cnt_stride bytes apart: thread mode gives every count its own cache line,
+//                              since each one is written by its own thread on every tick
+//   uint8 flags[capacity]      COUNTER_* bits
+//   uint64 resume_ns[capacity] virtual: steady clock (CLOCK_MONOTONIC) time of the last resume
+//   uint64 freq_hz[capacity]
+//   int32 max[capacity]
+// A running virtual counter reads (cnt + (now - resume_ns) * freq_hz / 1e9) % (max + 1).
+// Readers check magic and version first. Flags and configuration are consistent if seq was even
+// and unchanged around the read; counts alone need no retry.
+struct CounterHeader {
+    std::atomic<std::uint32_t> magic;   // Stored last, once everything else is initialized
+    std::uint32_t version;
+    std::uint32_t header_size;
+    std::uint32_t mode;                 // CounterMode
+    std::uint64_t capacity;
+    std::uint64_t cnt_offset;
+    std::uint64_t flag_offset;
+    std::uint64_t resume_offset;
+    std::uint64_t freq_offset;
+    std::uint64_t max_offset;
+    std::uint64_t pid;
+    std::uint64_t cnt_stride;
+    alignas(CACHE_LINE) std::atomic<std::uint64_t> seq;     // Kept off the line the readers poll above
+    std::atomic<std::uint64_t> slot_n;  // Slots up to the highest one ever used
+};
+
+static_assert(std::atomic<int>::is_always_lock_free && std::atomic<std::uint8_t>::is_always_lock_free
+              && std::atomic<std::uint64_t>::is_always_lock_free, "counter atomics must be usable across processes");
+
+// One cache-line-aligned block for the header and all arrays, from the heap or a named shared memory segment
+class CounterStorage {
+public:
+    CounterStorage(CounterMode mode, std::size_t n, const std::string &shm_name_):
+        shm_name(shm_name_) {
+        std::size_t offset = padded_size(sizeof(CounterHeader));
+        auto place = [&](std::size_t elem_size) {
+            auto at = offset;
+            offset += padded_size(n * elem_size);
+            return at;
+        };
+
+        auto cnt_stride = mode == CounterMode::Thread ? CACHE_LINE : sizeof(std::atomic_int);
+        auto cnt_offset = place(cnt_stride);
+        auto flag_offset = place(sizeof(std::atomic<std::uint8_t>));
+        auto resume_offset = place(sizeof(std::atomic<std::uint64_t>));
+        auto freq_offset = place(sizeof(std::atomic<std::uint64_t>));
+        auto max_offset = place(sizeof(std::atomic_int));
+
+        size = offset;
+
+        if (!shm_name.empty())
+            base = EnvShmCreate(shm_name, size, &CounterStorage::is_stale);
+
+        // Falls back to the heap, the owner checks is_shared()
+        if (base == nullptr) {
+            shm_name.clear();
+            base = ::operator new(size, std::align_val_t(CACHE_LINE));
+            std::memset(base, 0, size);
+        }
+
+        hdr = new (base) CounterHeader();
+        hdr->version = SHM_VERSION;
+        hdr->header_size = sizeof(CounterHeader);
+        hdr->mode = static_cast<std::uint32_t>(mode);
+        hdr->capacity = n;
+        hdr->cnt_offset = cnt_offset;
+        hdr->flag_offset = flag_offset;
+        hdr->resume_offset = resume_offset;
+        hdr->freq_offset = freq_offset;
+        hdr->max_offset = max_offset;
+        hdr->pid = EnvGetPid();
+        hdr->cnt_stride = cnt_stride;
+
+        construct<std::atomic_int>(cnt_offset, n, cnt_stride);
+        construct<std::atomic<std::uint8_t>>(flag_offset, n);
+        construct<std::atomic<std::uint64_t>>(resume_offset, n);
+        construct<std::atomic<std::uint64_t>>(freq_offset, n);
+        construct<std::atomic_int>(max_offset, n);
+    }
+
+    ~CounterStorage() {
+        if (is_shared())
+            EnvShmRelease(shm_name, base, size);
+        else
+            ::operator delete(base, std::align_val_t(CACHE_LINE));
+    }
+
+    CounterStorage(const CounterStorage &) = delete;
+    void operator=(const CounterStorage &) = delete;
+
+    bool is_shared() const {
+        return !shm_name.empty();
+    }
+
+    CounterHeader &header() {
+        return *hdr;
+    }
+
+    template <typename T>
+    T *array(std::uint64_t offset) {
+        return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+    }
+
+    void publish() {
+        hdr->magic.store(SHM_MAGIC, std::memory_order_release);
+    }
+
+private:
+    // A segment left behind by an instance that is gone, a live or unknown owner keeps its name
+    static bool is_stale(const void *ptr, std::size_t size) {
+        if (size < sizeof(CounterHeader))
+            return false;
+
+        auto pid = static_cast<const CounterHeader *>(ptr)->pid;
+
+        return pid != 0 && pid != EnvGetPid() && !EnvIsPidAlive(pid);
+    }
+
+    static std::size_t padded_size(std::size_t size) {
+        return std::max<std::size_t>((size + CACHE_LINE - 1) / CACHE_LINE, 1) * CACHE_LINE;
+    }
+
+    template <typename T>
+    void construct(std::uint64_t offset, std::size_t n, std::size_t stride = sizeof(T)) {
+        auto ptr = array<char>(offset);
+
+        for (std::size_t i = 0; i < n; i++)
+            new (ptr + i * stride) T(0);
+    }
+
+    std::string shm_name;
+    std::size_t size;
+    void *base = nullptr;
+    CounterHeader *hdr;
+};
+
+// Hot state of every counter in a pool, one contiguous array per field
+//
+// Pause, resume and reconfiguration are published under a seqlock, so snapshot() sees each of them entirely
+// or not at all. Ticks are single atomic updates of the counts and are not ordered against each other.
+// The arrays are sized once for the pool's capacity, slots are claimed and released in place.
+class CounterState {
+public:
+    CounterState(CounterMode mode_, std::size_t n_, std::size_t live_n, unsigned long freq_hz, int cnt_max, int cnt,
+                 const std::string &shm_name = ""):
+        mode(mode_), n(n_), storage(mode_, n_, shm_name), hdr(storage.header()),
+        cnt_arr(storage.array<std::atomic_int>(hdr.cnt_offset)),
+        cnt_stride(hdr.cnt_stride / sizeof(std::atomic_int)),
+        flag_arr(storage.array<std::atomic<std::uint8_t>>(hdr.flag_offset)),
+        resume_arr(storage.array<std::atomic<std::uint64_t>>(hdr.resume_offset)),
+        freq_arr(storage.array<std::atomic<std::uint64_t>>(hdr.freq_offset)),
+        max_arr(storage.array<std::atomic_int>(hdr.max_offset)) {
+        for (std::size_t i = 0; i < n; i++) {
+            cnt_at(i).store(i < live_n ? cnt : 0, std::memory_order_relaxed);
+            flag_arr[i].store(i < live_n ? COUNTER_PAUSE : COUNTER_PAUSE | COUNTER_FREE, std::memory_order_relaxed);
+            freq_arr[i].store(freq_hz, std::memory_order_relaxed);
+            max_arr[i].store(cnt_max, std::memory_order_relaxed);
+        }
+
+        hdr.slot_n.store(live_n, std::memory_order_relaxed);
+        storage.publish();
+    }
+
+    CounterState(const CounterState &) = delete;
+    void operator=(const CounterState &) = delete;
+
+    std::size_t size() const {
+        return n;
+    }
+
+    std::size_t slot_count() const {
+        return static_cast<std::size_t>(hdr.slot_n.load(std::memory_order_acquire));
+    }
+
+    bool is_shared() const {
+        return storage.is_shared();
+    }
+
+    std::atomic_int &cnt_at(std::size_t idx) {
+        return cnt_arr[idx * cnt_stride];
+    }
+
+    const std::atomic_int &cnt_at(std::size_t idx) const {
+        return cnt_arr[idx * cnt_stride];
+    }
+
+    const std::atomic<std::uint64_t> &freq_at(std::size_t idx) const {
+        return freq_arr[idx];
+    }
+
+    const std::atomic_int &max_at(std::size_t idx) const {
+        return max_arr[idx];
+    }
+
+    bool is_free(std::size_t idx) const {
+        return (flag_arr[idx].load(std::memory_order_acquire) & COUNTER_FREE) != 0;
+    }
+
+    bool is_paused(std::size_t idx) const {
+        return (flag_arr[idx].load(std::memory_order_acquire) & COUNTER_PAUSE) != 0;
+    }
+
+    bool is_stopped(std::size_t idx) const {
+        return (flag_arr[idx].load(std::memory_order_acquire) & COUNTER_STOP) != 0;
+    }
+
+    void stop(std::size_t idx) {
+        flag_arr[idx].fetch_or(COUNTER_STOP, std::memory_order_release);
+    }
+
+    // Consumes a COUNTER_REARM request
+    bool take_rearm(std::size_t idx) {
+        if ((flag_arr[idx].load(std::memory_order_relaxed) & COUNTER_REARM) == 0)
+            return false;
+
+        return (flag_arr[idx].fetch_and(~COUNTER_REARM, std::memory_order_acquire) & COUNTER_REARM) != 0;
+    }
+
+    // Turns a free slot into a paused counter, nothing may be ticking it
+    void claim(std::size_t idx, unsigned long freq_hz, int cnt_max, int cnt) {
+        std::lock_guard<std::mutex> lock(write_mutex);
+
+        write_begin();
+
+        cnt_at(idx).store(cnt, std::memory_order_relaxed);
+        freq_arr[idx].store(freq_hz, std::memory_order_relaxed);
+        max_arr[idx].store(cnt_max, std::memory_order_relaxed);
+        flag_arr[idx].store(COUNTER_PAUSE, std::memory_order_release);
+
+        if (idx >= slot_count())
+            hdr.slot_n.store(idx + 1, std::memory_order_release);
+
+        write_end();
+    }
+
+    // Frees a slot once its ticking thread is gone
+    void release(std::size_t idx) {
+        std::lock_guard<std::mutex> lock(write_mutex);
+
+        write_begin();
+
+        cnt_at(idx).store(0, std::memory_order_relaxed);
+        flag_arr[idx].store(COUNTER_PAUSE | COUNTER_FREE, std::memory_order_release);
+
+        write_end();
+    }
+
+    // Thread and wheel counters pick up the new rate when rearmed: on_change has to arrange that
+    // for running wheel counters, thread mode is told by COUNTER_REARM
+    template <typename F>
+    void retune(std::size_t idx, unsigned long freq_hz, int cnt_max, F &&on_change) {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        auto is_running = (flag_arr[idx].load(std::memory_order_relaxed) & COUNTER_PAUSE) == 0;
+
+        write_begin();
+
+        // Virtual counters start a new interval at the new rate
+        if (mode == CounterMode::Virtual && is_running) {
+            auto now_ns = NowNs();
+
+            cnt_at(idx).store(virtual_cnt(idx, now_ns), std::memory_order_relaxed);
+            resume_arr[idx].store(now_ns, std::memory_order_relaxed);
+        }
+
+        freq_arr[idx].store(freq_hz, std::memory_order_relaxed);
+
+        // Sequentially consistent against TimerEntry::add(), which re-checks max after its update
+        max_arr[idx].store(cnt_max);
+
+        auto cnt_now = cnt_at(idx).load();
+
+        while (cnt_now > cnt_max && !cnt_at(idx).compare_exchange_weak(cnt_now, cnt_now % (cnt_max + 1)))
+            ;
+
+        if (mode == CounterMode::Thread)
+            flag_arr[idx].fetch_or(COUNTER_REARM, std::memory_order_release);
+
+        on_change();
+
+        write_end();
+    }
+
+    void reset(std::size_t idx, int cnt) {
+        std::lock_guard<std::mutex> lock(write_mutex);
+
+        write_begin();
+
+        if (mode == CounterMode::Virtual)
+            resume_arr[idx].store(NowNs(), std::memory_order_relaxed);
+
+        cnt_at(idx).store(static_cast<int>(static_cast<unsigned>(cnt) % (static_cast<unsigned>(max_arr[idx]) + 1)),
+                           std::memory_order_relaxed);
+
+        write_end();
+    }
+
+    // on_change runs inside the write section, only if the pause state actually flips
+    template <typename F>
+    void pause(std::size_t idx, bool is_pause, F &&on_change) {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        auto flags = flag_arr[idx].load(std::memory_order_relaxed);
+
+        if (((flags & COUNTER_PAUSE) != 0) == is_pause)
+            return;
+
+        write_begin();
+
+        if (mode == CounterMode::Virtual) {
+            auto now_ns = NowNs();
+
+            // Fold the running interval into the base value, or start a new one
+            if (is_pause)
+                cnt_at(idx).store(virtual_cnt(idx, now_ns), std::memory_order_relaxed);
+            else
+                resume_arr[idx].store(now_ns, std::memory_order_relaxed);
+        }
+
+        flag_arr[idx].fetch_xor(COUNTER_PAUSE, std::memory_order_release);
+        on_change();
+
+        write_end();
+    }
+
+    int get(std::size_t idx) const {
+        int cnt = 0;
+
+        read([&](std::uint64_t now_ns) {
+            cnt = sample(idx, now_ns).cnt;
+        });
+
+        return cnt;
+    }
+
+    // Copies [first, first + count) in one sequential sweep, returns the sequence number of the view
+    std::uint64_t snapshot(std::vector<CounterSample> &out, std::size_t first, std::size_t count) const {
+        first = std::min(first, n);
+        count = std::min(count, n - first);
+
+        out.resize(count);
+
+        return read([&](std::uint64_t now_ns) {
+            for (std::size_t i = 0; i < count; i++)
+                out[i] = sample(first + i, now_ns);
+        });
+    }
+
+private:
+    void write_begin() {
+        hdr.seq.store(hdr.seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void write_end() {
+        hdr.seq.store(hdr.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Retries fn until it ran without a write section overlapping it
+    template <typename F>
+    std::uint64_t read(F &&fn) const {
+        while (true) {
+            auto seq_begin = hdr.seq.load(std::memory_order_acquire);
+
+            if (seq_begin & 1) {
+                CpuRelax();
+                continue;
+            }
+
+            fn(mode == CounterMode::Virtual ? NowNs() : 0);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (hdr.seq.load(std::memory_order_relaxed) == seq_begin)
+                return seq_begin / 2;
+        }
+    }
+
+    CounterSample sample(std::size_t idx, std::uint64_t now_ns) const {
+        auto flags = flag_arr[idx].load(std::memory_order_relaxed);
+        auto is_paused = (flags & COUNTER_PAUSE) != 0;
+
+        if (mode == CounterMode::Virtual && !is_paused)
+            return { virtual_cnt(idx, now_ns), false, false };
+
+        return { cnt_at(idx).load(std::memory_order_relaxed), is_paused, (flags & COUNTER_FREE) != 0 };
+    }
+
+    int virtual_cnt(std::size_t idx, std::uint64_t now_ns) const {
+        std::uint64_t cnt_mod = static_cast<std::uint64_t>(max_arr[idx].load(std::memory_order_relaxed)) + 1;
+        auto elapsed_ns = now_ns - resume_arr[idx].load(std::memory_order_relaxed);
+        auto ticks = MulDiv(elapsed_ns, freq_arr[idx].load(std::memory_order_relaxed), 1000000000);
+
+        return static_cast<int>((cnt_at(idx).load(std::memory_order_relaxed) + ticks % cnt_mod) % cnt_mod);
+    }
+
+    CounterMode mode;
+    std::size_t n;
+
+    CounterStorage storage;
+    CounterHeader &hdr;         // seq is the seqlock sequence
+
+    std::atomic_int *cnt_arr;                   // Virtual: value at resume_arr
+    std::size_t cnt_stride;                     // In elements, see CounterHeader
+    std::atomic<std::uint8_t> *flag_arr;
+    std::atomic<std::uint64_t> *resume_arr;
+    std::atomic<std::uint64_t> *freq_arr;
+    std::atomic_int *max_arr;
+
+    std::mutex write_mutex;     // Serializes writers, readers never take it
+};
+
+class CounterTask {
+public:
+    CounterTask(const CounterOptions &opts_, CounterState &state_, std::size_t idx_,
+                CounterScheduler *sched_ = nullptr, std::size_t worker_idx_ = 0, ChangeNotifier *notifier_ = nullptr):
+        mode(opts_.mode), spin_ns(opts_.spin_ns), placement(opts_.placement),
+        state(state_), idx(idx_), sched(sched_), worker_idx(worker_idx_) {
+        entry.cnt = &state.cnt_at(idx);
+        entry.freq_src = &state.freq_at(idx);
+        entry.max_src = &state.max_at(idx);
+        entry.catch_up = opts_.catch_up;
+        entry.notifier = notifier_;
+
+        if (mode == CounterMode::Thread) {
+            if (opts_.is_stats) {
+                stats = std::make_unique<TickStats>();
+                entry.stats = stats.get();
+            }
+
+            th = std::thread([this]() { thread_task(); });
+        }
+    }
+
+    ~CounterTask() {
+        state.stop(idx);
+        wake();
+
+        if (th.joinable())
+            th.join();
+    }
+
+    CounterTask(const CounterTask &) = delete;
+    void operator=(const CounterTask &) = delete;
+
+    int get_cnt() const {
+        return state.get(idx);
+    }
+
+    bool is_stopped() const {
+        return state.is_stopped(idx);
+    }
+
+    bool is_paused() const {
+        return state.is_paused(idx);
+    }
+
+    const TickStats *get_stats() const {
+        return stats.get();
+    }
+
+    void pause(bool is_pause_) {
+        state.pause(idx, is_pause_, [&]() {
+            if (mode == CounterMode::Wheel)
+                sched->post(worker_idx, &entry, !is_pause_);
+        });
+
+        wake();
+    }
+
+    void retune(unsigned long freq_hz, int cnt_max) {
+        state.retune(idx, freq_hz, cnt_max, [&]() {
+            if (mode == CounterMode::Wheel && !state.is_paused(idx))
+                sched->post(worker_idx, &entry, true);
+        });
+
+        wake();
+    }
+
+    // Wheel mode: takes the entry off its worker before the task is freed while the scheduler keeps running
+    void detach() {
+        if (mode == CounterMode::Wheel)
+            sched->wait(worker_idx, sched->post(worker_idx, &entry, false));
+    }
+
+private:
+    // Thread mode: ends a long sleep early, so stop, pause and retune take effect at once
+    void wake() {
+        if (mode != CounterMode::Thread)
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            is_woken = true;
+        }
+
+        wake_cv.notify_one();
+    }
+
+    // Returns early if woken, the caller re-checks the state and may sleep again
+    void sleep_until(std::uint64_t due_ns, bool is_spin) {
+        auto spin_now_ns = is_spin ? spin_ns : 0;
+
+        if (due_ns > NowNs() + spin_now_ns + THREAD_WAKE_MIN_NS) {
+            std::unique_lock<std::mutex> lock(wake_mutex);
+            auto wake_time = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(due_ns - spin_now_ns));
+
+            if (wake_cv.wait_until(lock, wake_time, [this]() { return is_woken; })) {
+                is_woken = false;
+                return;
+            }
+        }
+
+        SleepUntilNs(due_ns, spin_now_ns);
+    }
+
+    // Blocks until wake(), so a paused counter costs nothing until it is resumed or stopped
+    void wait_woken() {
+        std::unique_lock<std::mutex> lock(wake_mutex);
+
+        wake_cv.wait(lock, [this]() { return is_woken; });
+        is_woken = false;
+    }
+
+    void thread_task() {
+        // Deadlines are absolute from the last resume, so time spent ticking does not stretch the period
+        auto is_armed = false;
+
+        placement.apply(idx);
+
+        while (!state.is_stopped(idx)) {
+            if (state.is_paused(idx)) {
+                is_armed = false;
+                wait_woken();
+                continue;
+            }
+
+            auto now_ns = NowNs();
+
+            if (state.take_rearm(idx) || !is_armed) {
+                entry.arm(now_ns);
+                is_armed = true;
+            }
+
+            entry.fire(now_ns);
+            sleep_until(entry.due_ns, true);
+        }
+    }
+
+    CounterMode mode;
+    std::uint64_t spin_ns;
+    const ThreadPlacement &placement;   // Owned by the pool
+
+    CounterState &state;
+    std::size_t idx;
+    std::thread th;
+
+    CounterScheduler *sched;
+    std::size_t worker_idx;
+    TimerEntry entry;
+    std::unique_ptr<TickStats> stats;   // Thread mode only, wheel workers keep their own
+
+    std::mutex wake_mutex;
+    std::condition_variable wake_cv;
+    bool is_woken = false;
+};
+
+// Counters live in slots [0, capacity), removed ones leave a free slot that the next add() reuses
+class CounterTaskPool {
+public:
+    CounterTaskPool(const CounterOptions &opts_, std::size_t counter_n, unsigned long freq_hz_, int cnt_max_, int cnt_ = 0,
+                    std::size_t capacity = 0):
+        opts(opts_), freq_hz(freq_hz_), cnt_max(cnt_max_),
+        state(opts_.mode, std::max(capacity, counter_n), counter_n, freq_hz_, cnt_max_, cnt_, opts_.shm_name),
+        live_n(counter_n) {
+        if (opts.mode == CounterMode::Wheel)
+            sched = std::make_unique<CounterScheduler>(opts);
+        else
+            opts.placement.thread_n = std::max<std::size_t>(counter_n, 1);
+
+        // Virtual counters are computed from CounterState on read, they get no task at all
+        if (opts.mode == CounterMode::Virtual)
+            return;
+
+        task_vec.resize(state.size());
+
+        for (std::size_t i = 0; i < counter_n; i++)
+            task_vec[i] = make_task(i);
+    }
+
+    CounterTaskPool(const CounterTaskPool &) = delete;
+    void operator=(const CounterTaskPool &) = delete;
+
+    std::size_t get_capacity() const {
+        return state.size();
+    }
+
+    // Slots up to the highest one ever used, including free ones
+    std::size_t get_task_count() const {
+        return state.slot_count();
+    }
+
+    std::size_t get_live_count() const {
+        return live_n.load(std::memory_order_relaxed);
+    }
+
+    bool is_exported() const {
+        return state.is_shared();
+    }
+
+    unsigned long get_default_freq() const {
+        return freq_hz;
+    }
+
+    int get_default_max() const {
+        return cnt_max;
+    }
+
+    bool is_live(std::size_t idx) const {
+        return idx < state.size() && !state.is_free(idx);
+    }
+
+    bool is_paused(std::size_t idx) const {
+        return state.is_paused(idx);
+    }
+
+    unsigned long get_freq(std::size_t idx) const {
+        return static_cast<unsigned long>(state.freq_at(idx).load(std::memory_order_relaxed));
+    }
+
+    int get_max(std::size_t idx) const {
+        return state.max_at(idx).load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t snapshot(std::vector<CounterSample> &out, std::size_t first = 0, std::size_t count = SIZE_MAX) const {
+        return state.snapshot(out, first, count);
+    }
+
+    ChangeNotifier &get_notifier() {
+        return notifier;
+    }
+
+    void collect_stats(TickStats &out) const {
+        for (auto &task : task_vec)
+            if (task != nullptr && task->get_stats() != nullptr)
+                out.merge(*task->get_stats());
+
+        if (sched != nullptr)
+            sched->collect_stats(out);
+    }
 
-#if defined(__unix__)
+    // Everything below returns false (add: -1) for free slots or out of range values
 
-#include <unistd.h>
-#include <termios.h>
-#include <sys/ioctl.h>
+    bool pause(std::size_t idx, bool is_pause) {
+        std::lock_guard<std::mutex> lock(ctl_mutex);
 
-static void EnvSetup() {
-    termios attr;
+        if (!is_task(idx))
+            return false;
 
-    if (tcgetattr(STDIN_FILENO, &attr) == -1)
-        return;
+        if (opts.mode == CounterMode::Virtual)
+            state.pause(idx, is_pause, []() {});
+        else
+            task_vec[idx]->pause(is_pause);
 
-    attr.c_lflag &= ~(ICANON | ECHO);
-    attr.c_cc[VTIME] = 0;
-    attr.c_cc[VMIN] = 1;
+        return true;
+    }
 
-    tcsetattr(STDIN_FILENO, TCSANOW, &attr);
-}
+    // New counters start paused, in the lowest free slot
+    long add(unsigned long freq_hz_, int cnt_max_, int cnt_ = 0) {
+        std::lock_guard<std::mutex> lock(ctl_mutex);
+        std::size_t idx;
+
+        if (!is_config_ok(freq_hz_, cnt_max_))
+            return -1;
+
+        if (!free_slots.empty()) {
+            idx = free_slots.top();
+            free_slots.pop();
+        } else if (state.slot_count() < state.size()) {
+            idx = state.slot_count();
+        } else {
+            return -1;
+        }
 
-static void EnvClear() {
-    std::puts("\033[H\033[J");
-}
+        state.claim(idx, freq_hz_, cnt_max_, cnt_);
 
-static int EnvGetChar(bool is_nonblock) {
-    int len;
+        if (opts.mode != CounterMode::Virtual)
+            task_vec[idx] = make_task(idx);
 
-    if (ioctl(STDIN_FILENO, FIONREAD, &len) == -1)
-        return -1;
+        live_n.fetch_add(1, std::memory_order_relaxed);
 
-    if (is_nonblock && len < 1)
-        return -1;
+        return static_cast<long>(idx);
+    }
 
-    return std::getchar();
-}
+    bool remove(std::size_t idx) {
+        std::lock_guard<std::mutex> lock(ctl_mutex);
 
-#elif defined(_WIN32)
+        if (!is_task(idx))
+            return false;
 
-#include <windows.h>
-#include <conio.h>
+        if (opts.mode != CounterMode::Virtual) {
+            task_vec[idx]->detach();
+            task_vec[idx].reset();
+        }
 
-static void EnvSetup() {}
+        state.release(idx);
 
-static void EnvClear() {
-    auto hdl = GetStdHandle(STD_OUTPUT_HANDLE);
+        free_slots.push(idx);
+        live_n.fetch_sub(1, std::memory_order_relaxed);
 
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo(hdl, &csbi);
+        return true;
+    }
 
-    COORD coord = { 0, 0 };
-    DWORD cellCount = csbi.dwSize.X * csbi.dwSize.Y;
-    DWORD rowCount;
+    // freq_hz_ 0 or cnt_max_ -1 keep the current value
+    bool retune(std::size_t idx, unsigned long freq_hz_, int cnt_max_ = -1) {
+        std::lock_guard<std::mutex> lock(ctl_mutex);
 
-    FillConsoleOutputCharacter(hdl, ' ', cellCount, coord, &rowCount);
-    FillConsoleOutputAttribute(hdl, csbi.wAttributes, cellCount, coord, &rowCount);
-    SetConsoleCursorPosition(hdl, coord);
-}
+        if (!is_task(idx))
+            return false;
 
-static int EnvGetChar(bool is_nonblock) {
-    if (is_nonblock && !_kbhit())
-        return -1;
+        freq_hz_ = freq_hz_ > 0 ? freq_hz_ : get_freq(idx);
+        cnt_max_ = cnt_max_ >= 0 ? cnt_max_ : get_max(idx);
 
-    return _getch();
-}
+        if (!is_config_ok(freq_hz_, cnt_max_))
+            return false;
 
-#endif
+        if (opts.mode == CounterMode::Virtual)
+            state.retune(idx, freq_hz_, cnt_max_, []() {});
+        else
+            task_vec[idx]->retune(freq_hz_, cnt_max_);
 
-template <typename T>
-static void TrimTextL(T &s) {
-    s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](auto ch) {
-        return !std::isspace(ch);
-    }));
-}
+        return true;
+    }
 
-template <typename T>
-static void TrimTextR(T &s) {
-    s.erase(std::find_if(s.rbegin(), s.rend(), [](auto ch) {
-        return !std::isspace(ch);
-    }).base(), s.end());
-}
+    bool reset(std::size_t idx, int cnt_ = 0) {
+        std::lock_guard<std::mutex> lock(ctl_mutex);
 
-template <typename T>
-static void TrimText(T &s) {
-    TrimTextL(s);
-    TrimTextR(s);
-}
+        if (!is_task(idx) || cnt_ < 0)
+            return false;
 
-class CounterTask {
-public:
-    CounterTask(unsigned long freq_hz_, int cnt_max_, int cnt_ = 0):
-        freq_hz(freq_hz_), cnt_max(cnt_max_), cnt(cnt_),
-        th([this]() { thread_task(); }) {}
+        state.reset(idx, cnt_);
+        return true;
+    }
 
-    ~CounterTask() {
-        is_stop = true;
-        th.join();
+private:
+    // Counters sharing a cache line are ticked by the same worker
+    std::unique_ptr<CounterTask> make_task(std::size_t idx) {
+        return std::make_unique<CounterTask>(opts, state, idx, sched.get(), idx / (CACHE_LINE / sizeof(int)) % opts.worker_n,
+                                             opts.is_notify ? &notifier : nullptr);
     }
 
-    CounterTask(const CounterTask &) = delete;
-    void operator=(const CounterTask &) = delete;
+    // Whether idx holds a counter, virtual ones have no task and are only known by their slot
+    bool is_task(std::size_t idx) const {
+        if (opts.mode == CounterMode::Virtual)
+            return idx < state.size() && !state.is_free(idx);
 
-    int get_cnt() const {
-        return cnt.load(std::memory_order_relaxed);
+        return idx < task_vec.size() && task_vec[idx] != nullptr;
     }
 
-    bool is_stopped() const {
-        return is_stop;
+    static bool is_config_ok(unsigned long freq_hz_, int cnt_max_) {
+        return freq_hz_ > 0 && freq_hz_ <= FREQ_HZ_MAX && cnt_max_ >= 0;
     }
 
-    bool is_paused() const {
-        return is_pause;
-    }
+    CounterOptions opts;
+    unsigned long freq_hz;      // Defaults for add()
+    int cnt_max;
 
-    void pause(bool is_pause_) {
-        is_pause = is_pause_;
+    ChangeNotifier notifier;
+    CounterState state;
+
+    std::mutex ctl_mutex;       // Serializes add, remove and reconfiguration; ticks and snapshots never take it
+    std::vector<std::unique_ptr<CounterTask>> task_vec;    // Empty in virtual mode
+    std::priority_queue<std::size_t, std::vector<std::size_t>, std::greater<std::size_t>> free_slots;
+    std::atomic<std::size_t> live_n;
+
+    std::unique_ptr<CounterScheduler> sched;    // Stopped before the tasks it drives are freed
+};
+
+// Control channel commands, one per line:
+//   add [freq_hz [max]]          remove <idx>
+//   freq <idx|all> <freq_hz>     max <idx|all> <cnt_max>
+//   reset <idx|all> [cnt]        pause <idx|all>     resume <idx|all>
+static std::string RunCommand(CounterTaskPool &task_pool, const std::string &line) {
+    std::istringstream ss(line);
+    std::string cmd, target;
+    long long value = -1;
+
+    ss >> cmd;
+
+    if (cmd == "add") {
+        long long freq_hz = task_pool.get_default_freq(), cnt_max = task_pool.get_default_max();
+
+        if (!(ss >> freq_hz))
+            freq_hz = task_pool.get_default_freq();
+        else if (!(ss >> cnt_max))
+            cnt_max = task_pool.get_default_max();
+
+        if (freq_hz <= 0 || static_cast<unsigned long long>(freq_hz) > std::min<std::uint64_t>(FREQ_HZ_MAX, ULONG_MAX)
+            || cnt_max < 0 || cnt_max > INT_MAX)
+            return "add: bad freq or max";
+
+        auto idx = task_pool.add(static_cast<unsigned long>(freq_hz), static_cast<int>(cnt_max));
+
+        if (idx < 0)
+            return "add: pool is full (" + std::to_string(task_pool.get_capacity()) + " counters)";
+
+        return "counter" + std::to_string(idx) + " added";
     }
 
-private:
-    void thread_task() {
-        while (!is_stop) {
-            if (!is_pause)
-                cnt.store((cnt.load(std::memory_order_relaxed) + 1) % (cnt_max + 1), std::memory_order_release);
+    if (!(ss >> target))
+        return "unknown command: " + line;
 
-            std::this_thread::sleep_for(std::chrono::nanoseconds(1000000000 / freq_hz));
-        }
+    std::vector<std::size_t> idx_vec;
+
+    if (target == "all") {
+        for (std::size_t i = 0; i < task_pool.get_task_count(); i++)
+            if (task_pool.is_live(i))
+                idx_vec.push_back(i);
+    } else {
+        long long idx = -1;
+
+        if (!(std::istringstream(target) >> idx) || idx < 0 || !task_pool.is_live(static_cast<std::size_t>(idx)))
+            return cmd + ": no counter " + target;
+
+        idx_vec.push_back(static_cast<std::size_t>(idx));
     }
 
-    unsigned long freq_hz;
-    int cnt_max;
+    auto is_value = static_cast<bool>(ss >> value);
+    auto name = target == "all" ? std::to_string(idx_vec.size()) + " counters" : "counter" + target;
+    std::function<bool(std::size_t)> op;
+    std::string done;
+
+    if (cmd == "remove" && target != "all") {
+        if (task_pool.get_live_count() <= 1)
+            return "remove: cannot remove the last counter";
+
+        op = [&](std::size_t idx) { return task_pool.remove(idx); };
+        done = " removed";
+    } else if (cmd == "freq" && is_value && value > 0 && static_cast<unsigned long long>(value) <= std::min<std::uint64_t>(FREQ_HZ_MAX, ULONG_MAX)) {
+        op = [&](std::size_t idx) { return task_pool.retune(idx, static_cast<unsigned long>(value)); };
+        done = ": freq " + std::to_string(value) + " Hz";
+    } else if (cmd == "max" && is_value && value >= 0 && value <= INT_MAX) {
+        op = [&](std::size_t idx) { return task_pool.retune(idx, 0, static_cast<int>(value)); };
+        done = ": max " + std::to_string(value);
+    } else if (cmd == "reset" && (!is_value || (value >= 0 && value <= INT_MAX))) {
+        op = [&](std::size_t idx) { return task_pool.reset(idx, is_value ? static_cast<int>(value) : 0); };
+        done = " reset";
+    } else if (cmd == "pause" || cmd == "resume") {
+        op = [&](std::size_t idx) { return task_pool.pause(idx, cmd == "pause"); };
+        done = cmd == "pause" ? " paused" : " activated";
+    } else {
+        return "bad command: " + line;
+    }
 
-    std::atomic_int cnt;
-    std::thread th;
+    // Counters removed meanwhile are skipped
+    for (auto idx : idx_vec)
+        op(idx);
 
-    bool is_pause = true;
-    bool is_stop = false;
-};
+    return name + done;
+}
 
-class CounterTaskPool {
+// Applies commands read from a FIFO (a named pipe on Windows), the UI shows the last reply
+class ControlTask {
 public:
-    CounterTaskPool(std::size_t counter_n, unsigned long freq_hz_, int cnt_max_, int cnt_ = 0) {
-        task_vec.reserve(counter_n);
-
-        for (std::size_t i = 0; i < counter_n; i++)
-            task_vec.emplace_back(std::make_unique<CounterTask>(freq_hz_, cnt_max_, cnt_));
+    ControlTask(CounterTaskPool &task_pool_, const std::string &path):
+        task_pool(task_pool_), is_open(EnvCtlOpen(path)) {
+        if (is_open)
+            th = std::thread([this]() { thread_task(); });
     }
 
-    CounterTaskPool(const CounterTaskPool &) = delete;
-    void operator=(const CounterTaskPool &) = delete;
+    ~ControlTask() {
+        if (!is_open)
+            return;
 
-    std::size_t get_task_count() const {
-        return task_vec.size();
+        EnvCtlStop();
+        th.join();
+        EnvCtlClose();
     }
 
-    CounterTask &task_at(std::size_t idx) {
-        return *task_vec.at(idx);
+    ControlTask(const ControlTask &) = delete;
+    void operator=(const ControlTask &) = delete;
+
+    bool is_opened() const {
+        return is_open;
     }
 
-    const CounterTask &task_at(std::size_t idx) const {
-        return *task_vec.at(idx);
+    std::string take_reply() {
+        std::lock_guard<std::mutex> lock(reply_mutex);
+        std::string out;
+
+        out.swap(reply);
+        return out;
     }
 
 private:
-    std::vector<std::unique_ptr<CounterTask>> task_vec;
+    void thread_task() {
+        std::string buf;
+
+        while (EnvCtlRead(buf)) {
+            std::size_t pos;
+
+            while ((pos = buf.find('\n')) != std::string::npos) {
+                auto line = buf.substr(0, pos);
+
+                buf.erase(0, pos + 1);
+                TrimText(line);
+
+                if (line.empty())
+                    continue;
+
+                auto out = "ctl: " + RunCommand(task_pool, line);
+
+                {
+                    std::lock_guard<std::mutex> lock(reply_mutex);
+                    reply = std::move(out);
+                }
+
+                EnvNotify();
+            }
+
+            // A writer that never ends its line does not get to grow the buffer forever
+            if (buf.size() > 4096)
+                buf.clear();
+        }
+    }
+
+    CounterTaskPool &task_pool;
+    bool is_open;
+    std::thread th;
+
+    std::mutex reply_mutex;
+    std::string reply;
 };
 
+// Sleeps until input or the next refresh is due, then redraws the lines that changed
+// cb renders at most `rows` lines and may shorten the next sleep by setting wake_ms (-1: no own deadline)
+// An EnvNotify() only marks the frame dirty: it is drawn one frame period after the last one at the earliest,
+// so counters ticking at any rate cost at most refresh_hz (or UI_NOTIFY_HZ) frames per second
 class UiRenderer {
 public:
-    UiRenderer(long tick_ms_):
-        tick_ms(tick_ms_) {}
+    UiRenderer(unsigned long refresh_hz_):
+        refresh_hz(refresh_hz_) {}
 
-    void run(const std::function<bool (std::ostream &)> &cb) const {
-        std::string last_out;
+    void run(const std::function<bool (std::ostream &, std::size_t, long &)> &cb) const {
+        std::vector<std::string> last_lines;
+        std::size_t last_rows = 0, last_cols = 0;
+        auto next_refresh = std::chrono::steady_clock::now();
 
         EnvSetup();
 
         while (true) {
             std::ostringstream ss;
+            std::size_t rows, cols;
+            long wake_ms = -1;
 
-            auto is_continue = cb(ss);
-            auto out = ss.str();
+            EnvGetSize(rows, cols);
 
-            if (out != last_out) {
+            auto is_continue = cb(ss, rows, wake_ms);
+            auto lines = split_lines(ss.str(), rows, cols);
+
+            if (rows != last_rows || cols != last_cols) {
                 EnvClear();
-                std::puts(out.c_str());
 
-                last_out = out;
+                last_lines.clear();
+                last_rows = rows;
+                last_cols = cols;
             }
 
+            draw(lines, last_lines);
+            last_lines = std::move(lines);
+
             if (!is_continue)
                 break;
 
-            std::this_thread::sleep_for(std::chrono::milliseconds(tick_ms));
+            auto frame_time = std::chrono::steady_clock::now();
+            auto deadline = std::chrono::steady_clock::time_point::max();
+
+            if (wake_ms >= 0)
+                deadline = frame_time + std::chrono::milliseconds(wake_ms);
+
+            if (refresh_hz > 0) {
+                auto period = std::chrono::nanoseconds(1000000000 / refresh_hz);
+
+                // Fixed refresh grid, frames missed while busy are dropped
+                if (next_refresh <= frame_time)
+                    next_refresh += period * ((frame_time - next_refresh) / period + 1);
+
+                deadline = std::min(deadline, next_refresh);
+            }
+
+            wait_frame(frame_time, deadline);
         }
     }
 
 private:
-    long tick_ms;
+    // Returns on input or at the deadline, which a notification may pull in to one frame period after frame_time
+    void wait_frame(std::chrono::steady_clock::time_point frame_time, std::chrono::steady_clock::time_point deadline) const {
+        auto frame_period = std::chrono::nanoseconds(1000000000 / (refresh_hz > 0 ? refresh_hz : UI_NOTIFY_HZ));
+
+        while (true) {
+            auto now = std::chrono::steady_clock::now();
+            long timeout_ms = -1;
+
+            if (deadline != std::chrono::steady_clock::time_point::max()) {
+                if (now >= deadline)
+                    return;
+
+                timeout_ms = std::chrono::ceil<std::chrono::milliseconds>(deadline - now).count();
+            }
+
+            auto woken = EnvWait(timeout_ms);
+
+            if (woken & ENV_WAKE_INPUT)
+                return;
+
+            if (woken & ENV_WAKE_NOTIFY)
+                deadline = std::min(deadline, frame_time + frame_period);
+        }
+    }
+
+    // Lines are clipped to the window, a wrapped line would shift every row below it
+    static std::vector<std::string> split_lines(const std::string &out, std::size_t rows, std::size_t cols) {
+        std::vector<std::string> lines;
+        std::istringstream ss(out);
+        std::string line;
+
+        while (lines.size() < rows && std::getline(ss, line))
+            lines.emplace_back(line.substr(0, cols));
+
+        return lines;
+    }
+
+    // Emits one cursor-addressed update per changed line, all in a single write
+    static void draw(const std::vector<std::string> &lines, const std::vector<std::string> &last_lines) {
+        std::string buf;
+
+        for (std::size_t i = 0; i < std::max(lines.size(), last_lines.size()); i++) {
+            if (i < lines.size() && i < last_lines.size() && lines[i] == last_lines[i])
+                continue;
+
+            buf += "\033[" + std::to_string(i + 1) + ";1H";
+
+            if (i < lines.size())
+                buf += lines[i];
+
+            buf += "\033[K";
+        }
+
+        if (buf.empty())
+            return;
+
+        buf += "\033[" + std::to_string(lines.size() + 1) + ";1H";
+        EnvWrite(buf);
+    }
+
+    unsigned long refresh_hz;   // 0: redraw on input and notifications only
 };
 
 class UiTask {
 public:
-    UiTask(CounterTaskPool &task_pool_):
-        task_pool(task_pool_),
+    UiTask(CounterTaskPool &task_pool_, unsigned long refresh_hz_, int ui_cpu_ = -1, ControlTask *ctl_ = nullptr):
+        task_pool(task_pool_), refresh_hz(refresh_hz_), ui_cpu(ui_cpu_), ctl(ctl_),
         th([this]() { thread_task(); }) {}
 
     ~UiTask() {
@@ -235,74 +2519,402 @@ private:
         std::string alert;
         auto alert_time = std::chrono::steady_clock::now();
         std::size_t cur_task_idx = 0;
+        std::size_t top_task_idx = 0;
+        std::vector<CounterSample> samples;
+        unsigned shown_failed = 0;
 
-        UiRenderer(1).run([&](auto &out) {
-            auto &task = task_pool.task_at(cur_task_idx);
-            auto ch = EnvGetChar(true);
+        if (ui_cpu >= 0 && !EnvSetAffinity({ ui_cpu })) {
+            alert = "cannot pin ui to cpu" + std::to_string(ui_cpu);
+            alert_time = std::chrono::steady_clock::now();
+        }
+
+        auto set_alert = [&](const std::string &msg) {
+            alert = msg;
+            alert_time = std::chrono::steady_clock::now();
+        };
+
+        UiRenderer(refresh_hz).run([&](auto &out, auto rows, auto &wake_ms) {
+            auto ch = EnvGetKey();
+
+            // Footer: blank line, alert, current counter, cursor
+            auto view_n = rows > 5 ? rows - 4 : 1;
+
+            task_pool.get_notifier().consume();
+
+            if (ctl != nullptr) {
+                auto reply = ctl->take_reply();
+
+                if (!reply.empty())
+                    set_alert(reply);
+            }
 
-            if (!alert.empty())
-                if ((std::chrono::steady_clock::now() - alert_time) >= std::chrono::milliseconds(2000))
+            // The current counter may have been removed through the control channel
+            if (!task_pool.is_live(cur_task_idx))
+                cur_task_idx = next_live(cur_task_idx);
+
+            // Placement warnings on stderr are drawn over, repeat them here
+            auto failed = placement_failed.load(std::memory_order_relaxed);
+
+            if (failed != shown_failed) {
+                alert = (failed & PLACEMENT_AFFINITY_FAILED) ? "warning: cannot set cpu affinity" : "";
+                alert += (failed & PLACEMENT_REALTIME_FAILED) ? " warning: SCHED_FIFO not permitted" : "";
+                alert += (failed & PLACEMENT_NICE_FAILED) ? " warning: nice level not permitted" : "";
+                TrimText(alert);
+                alert_time = std::chrono::steady_clock::now();
+                shown_failed = failed;
+            }
+
+            if (!alert.empty()) {
+                auto alert_left = std::chrono::milliseconds(2000) - (std::chrono::steady_clock::now() - alert_time);
+
+                if (alert_left <= std::chrono::milliseconds(0))
                     alert.clear();
+                else
+                    wake_ms = std::chrono::ceil<std::chrono::milliseconds>(alert_left).count();
+            }
 
             switch (ch) {
             case 'q':
                 out << "stopping, please wait...\n";
                 return false;
 
-            case 'n':
-                alert = "counter" + std::to_string(cur_task_idx);
-                cur_task_idx = (cur_task_idx + 1) % task_pool.get_task_count();
-                alert += " -> counter" + std::to_string(cur_task_idx);
-                alert_time = std::chrono::steady_clock::now();
+            case 'n': {
+                auto prev_task_idx = cur_task_idx;
+
+                cur_task_idx = next_live(cur_task_idx);
+                set_alert("counter" + std::to_string(prev_task_idx) + " -> counter" + std::to_string(cur_task_idx));
                 break;
+            }
 
             case ' ':
-                task.pause(!task.is_paused());
-                alert = "counter" + std::to_string(cur_task_idx) + (task.is_paused() ? " paused" : " activated");
-                alert_time = std::chrono::steady_clock::now();
+                task_pool.pause(cur_task_idx, !task_pool.is_paused(cur_task_idx));
+                set_alert("counter" + std::to_string(cur_task_idx) + (task_pool.is_paused(cur_task_idx) ? " paused" : " activated"));
+                break;
+
+            case 'a': {
+                auto idx = task_pool.add(task_pool.get_default_freq(), task_pool.get_default_max());
+
+                if (idx < 0) {
+                    set_alert("pool is full (" + std::to_string(task_pool.get_capacity()) + " counters)");
+                } else {
+                    cur_task_idx = static_cast<std::size_t>(idx);
+                    set_alert("counter" + std::to_string(idx) + " added");
+                }
+                break;
+            }
+
+            case 'd':
+                if (task_pool.get_live_count() <= 1) {
+                    set_alert("cannot remove the last counter");
+                } else {
+                    task_pool.remove(cur_task_idx);
+                    set_alert("counter" + std::to_string(cur_task_idx) + " removed");
+                    cur_task_idx = next_live(cur_task_idx);
+                }
+                break;
+
+            case 'r':
+                task_pool.reset(cur_task_idx);
+                set_alert("counter" + std::to_string(cur_task_idx) + " reset");
+                break;
+
+            case 'R':
+                set_alert(RunCommand(task_pool, "reset all"));
+                break;
+
+            case '+':
+            case '-': {
+                std::uint64_t freq_hz = task_pool.get_freq(cur_task_idx);
+
+                freq_hz = ch == '+' ? std::min<std::uint64_t>(freq_hz * 2, std::min<std::uint64_t>(FREQ_HZ_MAX, ULONG_MAX))
+                                    : std::max<std::uint64_t>(freq_hz / 2, 1);
+                task_pool.retune(cur_task_idx, static_cast<unsigned long>(freq_hz));
+                set_alert("counter" + std::to_string(cur_task_idx) + ": freq " + std::to_string(freq_hz) + " Hz");
                 break;
             }
 
-            for (std::size_t i = 0; i < task_pool.get_task_count(); i++) {
-                auto &task = task_pool.task_at(i);
-                out << "counter" << i << " : " << task.get_cnt() << " (" << (task.is_paused() ? "paused" : "counting") << ")\n";
+            case ']':
+            case '[': {
+                std::uint64_t cnt_max = task_pool.get_max(cur_task_idx);
+
+                cnt_max = ch == ']' ? std::min<std::uint64_t>(cnt_max * 2 + 1, INT_MAX) : cnt_max / 2;
+                task_pool.retune(cur_task_idx, 0, static_cast<int>(cnt_max));
+                set_alert("counter" + std::to_string(cur_task_idx) + ": max " + std::to_string(cnt_max));
+                break;
+            }
+
+            case 'j':
+                top_task_idx++;
+                break;
+
+            case 'k':
+                top_task_idx = top_task_idx > 0 ? top_task_idx - 1 : 0;
+                break;
+
+            case 'f':
+                top_task_idx += view_n;
+                break;
+
+            case 'b':
+                top_task_idx = top_task_idx > view_n ? top_task_idx - view_n : 0;
+                break;
+            }
+
+            auto task_n = task_pool.get_task_count();
+
+            // Keep the current counter in view after it moved
+            if (ch == 'n' || ch == 'a' || ch == 'd') {
+                if (cur_task_idx < top_task_idx || cur_task_idx >= top_task_idx + view_n)
+                    top_task_idx = cur_task_idx;
             }
 
+            top_task_idx = std::min(top_task_idx, task_n > view_n ? task_n - view_n : 0);
+
+            // Only the counters in the window are read and formatted, free slots are skipped
+            task_pool.snapshot(samples, top_task_idx, view_n);
+
+            for (std::size_t i = 0; i < samples.size(); i++)
+                if (!samples[i].is_free)
+                    out << "counter" << top_task_idx + i << " : " << samples[i].cnt << " (" << (samples[i].is_paused ? "paused" : "counting") << ")\n";
+
             out << '\n' << alert;
-            out << "\ncurrent: counter" << cur_task_idx << " (" << (task.is_paused() ? "paused" : "counting") << ")\n";
+            out << "\ncurrent: counter" << cur_task_idx << " (" << (task_pool.is_paused(cur_task_idx) ? "paused" : "counting") << ", "
+                << task_pool.get_freq(cur_task_idx) << " Hz, max " << task_pool.get_max(cur_task_idx) << ")";
+
+            if (task_n > view_n)
+                out << "  [" << top_task_idx << '-' << std::min(top_task_idx + view_n, task_n) - 1 << " of " << task_n << ", j/k f/b to scroll]";
+
+            out << '\n';
 
             return true;
         });
     }
 
+    // Next counter after idx in slot order, wrapping around; idx itself if it is the only one
+    std::size_t next_live(std::size_t idx) const {
+        auto task_n = task_pool.get_task_count();
+
+        for (std::size_t i = 1; i <= task_n; i++) {
+            auto next_idx = (idx + i) % task_n;
+
+            if (task_pool.is_live(next_idx))
+                return next_idx;
+        }
+
+        return idx;
+    }
+
     CounterTaskPool &task_pool;
+    unsigned long refresh_hz;
+    int ui_cpu;
+    ControlTask *ctl;
     std::thread th;
 };
 
+static const char *const MODE_NAMES[] = { "thread", "virtual", "wheel" };
+static const char *const CATCH_UP_NAMES[] = { "burst", "skip" };
+
+// Headless run of every (n, freq) combination for a fixed duration, one CSV row each
+static void RunBench(const CounterOptions &opts_, const std::vector<std::uint64_t> &n_list,
+                     const std::vector<std::uint64_t> &freq_list, double duration_s) {
+    auto opts = opts_;
+
+    opts.is_notify = false;
+    opts.is_stats = true;
+
+    std::printf("mode,catchup,workers,n,freq_hz,duration_s,achieved_hz,error_pct,wakeups,"
+                "late_p50_ns,late_p99_ns,late_max_ns,cpu_user_s,cpu_sys_s,vol_switches,invol_switches\n");
+
+    for (auto counter_n : n_list) {
+        for (auto freq_hz : freq_list) {
+            CounterTaskPool task_pool(opts, counter_n, freq_hz, INT_MAX);
+            TickStats stats;
+            EnvUsage usage_begin, usage_end;
+
+            EnvGetUsage(usage_begin);
+
+            auto resume_begin = NowNs();
+
+            for (std::size_t i = 0; i < counter_n; i++)
+                task_pool.pause(i, false);
+
+            // Counters resumed over the sweep, measure from its midpoint
+            auto start_ns = resume_begin + (NowNs() - resume_begin) / 2;
+
+            std::this_thread::sleep_for(std::chrono::duration<double>(duration_s));
+
+            task_pool.collect_stats(stats);
+
+            auto end_ns = NowNs();
+            auto elapsed_s = (end_ns - start_ns) / 1e9;
+
+            EnvGetUsage(usage_end);
+
+            // Virtual counters never tick, their value is computed from the clock on read,
+            // so the rate matches freq_hz by construction and the rate columns stay empty
+            char achieved_hz_str[32] = "", error_pct_str[32] = "";
+
+            if (opts.mode != CounterMode::Virtual) {
+                auto achieved_hz = stats.get_tick_count() / static_cast<double>(counter_n) / elapsed_s;
+
+                std::snprintf(achieved_hz_str, sizeof(achieved_hz_str), "%.3f", achieved_hz);
+                std::snprintf(error_pct_str, sizeof(error_pct_str), "%.3f", (achieved_hz - freq_hz) * 100 / freq_hz);
+            }
+
+            std::printf("%s,%s,%zu,%llu,%llu,%.3f,%s,%s,%llu,%llu,%llu,%llu,%.3f,%.3f,%ld,%ld\n",
+                        MODE_NAMES[static_cast<int>(opts.mode)], CATCH_UP_NAMES[static_cast<int>(opts.catch_up)],
+                        opts.mode == CounterMode::Wheel ? opts.worker_n : 0,
+                        static_cast<unsigned long long>(counter_n), static_cast<unsigned long long>(freq_hz),
+                        elapsed_s, achieved_hz_str, error_pct_str,
+                        static_cast<unsigned long long>(stats.get_wake_count()),
+                        static_cast<unsigned long long>(stats.percentile_ns(0.50)),
+                        static_cast<unsigned long long>(stats.percentile_ns(0.99)),
+                        static_cast<unsigned long long>(stats.get_max_ns()),
+                        usage_end.user_s - usage_begin.user_s, usage_end.sys_s - usage_begin.sys_s,
+                        usage_end.vol_switch_n - usage_begin.vol_switch_n,
+                        usage_end.invol_switch_n - usage_begin.invol_switch_n);
+            std::fflush(stdout);
+        }
+    }
+}
+
 int main(int argc, char **argv) {
-    std::size_t counter_n = 0;
-    unsigned long freq_hz = 0;
+    std::vector<std::uint64_t> n_list, freq_list;
     long cnt_max = -1;
+    CounterOptions opts;
+    auto is_opts_ok = true;
+    unsigned long refresh_hz = 30;
+    double bench_s = 0;
+    long ui_cpu = -1;
+    auto &placement = opts.placement;
+    std::size_t capacity = 0;
+    std::string ctl_path;
+
+    opts.worker_n = std::max(std::thread::hardware_concurrency(), 1u);
 
     for (int i = 1; i < argc; i++) {
         std::string part(argv[i]);
         TrimText(part);
 
         if (part.find("n=") == 0)
-            counter_n = std::strtoul(part.substr(sizeof("n")).c_str(), nullptr, 0);
+            n_list = ParseList(part.substr(sizeof("n")));
         else if (part.find("freq=") == 0)
-            freq_hz = std::strtoul(part.substr(sizeof("freq")).c_str(), nullptr, 0);
+            freq_list = ParseList(part.substr(sizeof("freq")));
         else if (part.find("max=") == 0)
             cnt_max = std::strtol(part.substr(sizeof("max")).c_str(), nullptr, 0);
+        else if (part == "mode=thread")
+            opts.mode = CounterMode::Thread;
+        else if (part == "mode=virtual")
+            opts.mode = CounterMode::Virtual;
+        else if (part == "mode=wheel")
+            opts.mode = CounterMode::Wheel;
+        else if (part.find("mode=") == 0)
+            is_opts_ok = false;
+        else if (part.find("workers=") == 0)
+            opts.worker_n = std::strtoul(part.substr(sizeof("workers")).c_str(), nullptr, 0);
+        else if (part == "catchup=burst")
+            opts.catch_up = CatchUp::Burst;
+        else if (part == "catchup=skip")
+            opts.catch_up = CatchUp::Skip;
+        else if (part.find("catchup=") == 0)
+            is_opts_ok = false;
+        else if (part.find("spin=") == 0)
+            opts.spin_ns = std::strtoull(part.substr(sizeof("spin")).c_str(), nullptr, 0);
+        else if (part.find("refresh=") == 0)
+            refresh_hz = std::strtoul(part.substr(sizeof("refresh")).c_str(), nullptr, 0);
+        else if (part.find("notify=") == 0)
+            opts.is_notify = std::strtoul(part.substr(sizeof("notify")).c_str(), nullptr, 0) != 0;
+        else if (part.find("bench=") == 0)
+            bench_s = std::strtod(part.substr(sizeof("bench")).c_str(), nullptr);
+        else if (part.find("cpus=") == 0)
+            is_opts_ok = ParseCpuList(part.substr(sizeof("cpus")), placement.cpus) && is_opts_ok;
+        else if (part == "pin=none")
+            placement.pin = PinMode::None;
+        else if (part == "pin=rr")
+            placement.pin = PinMode::RoundRobin;
+        else if (part == "pin=packed")
+            placement.pin = PinMode::Packed;
+        else if (part.find("pin=") == 0)
+            is_opts_ok = false;
+        else if (part.find("ui_cpu=") == 0)
+            ui_cpu = std::strtol(part.substr(sizeof("ui_cpu")).c_str(), nullptr, 0);
+        else if (part == "sched=other")
+            placement.is_realtime = false;
+        else if (part == "sched=fifo" || part.find("sched=fifo:") == 0) {
+            placement.is_realtime = true;
+
+            if (part.size() > sizeof("sched=fifo"))
+                placement.realtime_prio = std::strtol(part.substr(sizeof("sched=fifo")).c_str(), nullptr, 0);
+        }
+        else if (part.find("sched=") == 0)
+            is_opts_ok = false;
+        else if (part.find("cap=") == 0)
+            capacity = std::strtoull(part.substr(sizeof("cap")).c_str(), nullptr, 0);
+        else if (part.find("ctl=") == 0)
+            ctl_path = part.substr(sizeof("ctl"));
+        else if (part.find("shm=") == 0)
+            opts.shm_name = part.substr(sizeof("shm"));
+        else if (part.find("nice=") == 0) {
+            placement.is_nice = true;
+            placement.nice = std::strtol(part.substr(sizeof("nice")).c_str(), nullptr, 0);
+        }
+    }
+
+    // Pinning or isolating the ui needs the cpu set spelled out; the ui cpu is kept free of counters
+    if (placement.cpus.empty() && (placement.pin != PinMode::None || ui_cpu >= 0) && !EnvGetCpus(placement.cpus))
+        std::fprintf(stderr, "warning: cannot query available cpus, counters are not pinned\n");
+
+    if (ui_cpu >= 0 && !placement.cpus.empty()) {
+        auto counter_cpus = placement.cpus;
+        counter_cpus.erase(std::remove(counter_cpus.begin(), counter_cpus.end(), ui_cpu), counter_cpus.end());
+
+        if (counter_cpus.empty())
+            std::fprintf(stderr, "warning: no cpu left besides ui_cpu=%ld, counters share it\n", ui_cpu);
+        else
+            placement.cpus = counter_cpus;
     }
 
-    if (counter_n == 0 || freq_hz == 0 || cnt_max < 0 || cnt_max > INT_MAX) {
-        std::printf(MSG_HELP, argc > 0 ? argv[0] : "");
+    auto is_list_ok = [](const std::vector<std::uint64_t> &list, std::uint64_t max) {
+        return !list.empty() && std::all_of(list.begin(), list.end(), [&](auto v) { return v > 0 && v <= max; });
+    };
+
+    // Sweeps take lists, the interactive mode exactly one n and freq
+    if (!is_list_ok(n_list, SIZE_MAX) || !is_list_ok(freq_list, std::min<std::uint64_t>(FREQ_HZ_MAX, ULONG_MAX))
+        || (bench_s <= 0 && (n_list.size() != 1 || freq_list.size() != 1 || cnt_max < 0 || cnt_max > INT_MAX))
+        || !is_opts_ok || opts.worker_n == 0 || refresh_hz > 1000 || ui_cpu > INT_MAX) {
+        auto name = argc > 0 ? argv[0] : "";
+        std::printf(MSG_HELP, name, name);
         std::exit(1);
     }
 
-    CounterTaskPool task_pool(counter_n, freq_hz, cnt_max);
-    UiTask ui_task(task_pool);
+    if (bench_s > 0) {
+        RunBench(opts, n_list, freq_list, bench_s);
+        return 0;
+    }
+
+    // Room for counters added at runtime
+    if (capacity == 0)
+        capacity = std::max<std::size_t>(n_list[0] * 2, 64);
+
+    CounterTaskPool task_pool(opts, n_list[0], freq_list[0], cnt_max, 0, capacity);
+    std::unique_ptr<ControlTask> ctl;
+
+    if (!opts.shm_name.empty() && !task_pool.is_exported()) {
+        std::fprintf(stderr, "%s: cannot create shared memory segment, or it belongs to a running instance\n",
+                     opts.shm_name.c_str());
+        return 1;
+    }
+
+    if (!ctl_path.empty()) {
+        ctl = std::make_unique<ControlTask>(task_pool, ctl_path);
+
+        if (!ctl->is_opened()) {
+            std::fprintf(stderr, "%s: cannot open control channel\n", ctl_path.c_str());
+            return 1;
+        }
+    }
+
+    UiTask ui_task(task_pool, refresh_hz, static_cast<int>(ui_cpu), ctl.get());
 
     return 0;
 }
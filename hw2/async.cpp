@@ -0,0 +1,208 @@
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <exception>
+#include <algorithm>
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include "queue.h"
+#include "queue_async.h"
+
+// Many consumer and producer coroutines sharing one bounded queue, served by a few threads
+// Consumers park inside the queue while it is empty, producers while it is full
+
+#define MSG_HELP "usage: %s consumers=[n] producers=[n] items=[per producer] capacity=[n] threads=[n]\n"
+
+class ThreadPool {
+public:
+    ThreadPool(std::size_t thread_n) {
+        for (std::size_t i = 0; i < thread_n; i++)
+            th_vec.emplace_back([this]() { thread_task(); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            is_stop = true;
+        }
+
+        cv.notify_all();
+
+        for (auto& th : th_vec)
+            th.join();
+    }
+
+    void post(std::coroutine_handle<> handle) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.push_back(handle);
+        }
+
+        cv.notify_one();
+    }
+
+private:
+    void thread_task() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true) {
+            cv.wait(lock, [this]() { return is_stop || !ready.empty(); });
+
+            if (ready.empty())
+                return;
+
+            auto handle = ready.front();
+            ready.pop_front();
+
+            lock.unlock();
+            handle.resume();
+            lock.lock();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::coroutine_handle<>> ready;
+    bool is_stop = false;
+    std::vector<std::thread> th_vec;
+};
+
+// Fire and forget: runs on the spawning thread up to its first suspension, frees itself when done
+struct Task {
+    struct promise_type {
+        Task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+class Latch {
+public:
+    Latch(std::size_t n_): n(n_) {}
+
+    void count_down() {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (--n == 0)
+            cv.notify_all();
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]() { return n == 0; });
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::size_t n;
+};
+
+// Keys 1..consumer_n stop the consumers, they are only enqueued after every data item
+static Task consumer_func(Queue* queue, ThreadPool& pool, std::size_t consumer_n,
+                         std::atomic<std::size_t>& consumed, Latch& done) {
+    while (true) {
+        auto reply = co_await async_dequeue(queue, pool);
+
+        if (!reply.success)
+            break;
+
+        std::free(reply.item.value);
+
+        if (reply.item.key <= consumer_n)
+            break;
+
+        consumed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    done.count_down();
+}
+
+static Task producer_func(Queue* queue, ThreadPool& pool, Key first_key, std::size_t item_n, Latch& done) {
+    int payload = 0;
+
+    for (std::size_t i = 0; i < item_n; i++) {
+        payload = static_cast<int>(i);
+
+        Item item = { static_cast<Key>(first_key + i), &payload, sizeof(payload) };
+        co_await async_enqueue(queue, item, pool);
+    }
+
+    done.count_down();
+}
+
+int main(int argc, char** argv) {
+    std::size_t consumer_n = 10000, producer_n = 100, item_n = 1000, capacity = 64;
+    std::size_t thread_n = std::max(std::thread::hardware_concurrency(), 1u);
+
+    for (int i = 1; i < argc; i++) {
+        std::string part(argv[i]);
+
+        if (part.find("consumers=") == 0)
+            consumer_n = std::strtoull(part.substr(sizeof("consumers")).c_str(), nullptr, 0);
+        else if (part.find("producers=") == 0)
+            producer_n = std::strtoull(part.substr(sizeof("producers")).c_str(), nullptr, 0);
+        else if (part.find("items=") == 0)
+            item_n = std::strtoull(part.substr(sizeof("items")).c_str(), nullptr, 0);
+        else if (part.find("capacity=") == 0)
+            capacity = std::strtoull(part.substr(sizeof("capacity")).c_str(), nullptr, 0);
+        else if (part.find("threads=") == 0)
+            thread_n = std::strtoull(part.substr(sizeof("threads")).c_str(), nullptr, 0);
+    }
+
+    // Keys are unique in the queue, every item and stop signal needs its own
+    if (consumer_n == 0 || producer_n == 0 || capacity == 0 || thread_n == 0
+        || consumer_n + producer_n * item_n >= UINT32_MAX) {
+        std::printf(MSG_HELP, argc > 0 ? argv[0] : "");
+        std::exit(1);
+    }
+
+    auto queue = init_bounded(capacity);
+
+    if (queue == nullptr) {
+        std::fprintf(stderr, "queue init failed\n");
+        std::exit(1);
+    }
+
+    std::atomic<std::size_t> consumed(0);
+    Latch consumer_done(consumer_n), producer_done(producer_n), stop_done(1);
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    {
+        ThreadPool pool(thread_n);
+
+        for (std::size_t i = 0; i < consumer_n; i++)
+            consumer_func(queue, pool, consumer_n, consumed, consumer_done);
+
+        for (std::size_t i = 0; i < producer_n; i++)
+            producer_func(queue, pool, static_cast<Key>(consumer_n + 1 + i * item_n), item_n, producer_done);
+
+        producer_done.wait();
+
+        // Queued behind every data item, so consumers drain the data first
+        producer_func(queue, pool, 1, consumer_n, stop_done);
+
+        stop_done.wait();
+        consumer_done.wait();
+    }
+
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+    release(queue);
+
+    std::printf("%zu consumers, %zu producers, %zu threads, capacity %zu\n", consumer_n, producer_n, thread_n, capacity);
+    std::printf("consumed %zu of %zu items in %.6f s, %.0f items/s\n",
+        consumed.load(), producer_n * item_n, elapsed, elapsed > 0 ? consumed.load() / elapsed : 0.0);
+
+    return consumed.load() == producer_n * item_n ? 0 : 1;
+}
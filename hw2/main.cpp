@@ -2,7 +2,10 @@
 #include <thread>
 #include <atomic>
 #include <stdint.h>
+#include <string>
+#include <cstdlib>
 #include "queue.h"
+#include "trace.h"
 
 using namespace std;
 
@@ -44,7 +47,12 @@ void client_func(Queue* queue, Request requests[], int n_request) {
 			// 단순히 리턴받은 키 값을 더함(아무 의미 없음)
 			sum_key += reply.item.key;
 			// sum_value += (int)reply.item.value; // void*에서 다시 int로 변환
-			sum_value += reinterpret_cast<long>(reply.item.value);
+			if (reply.item.value != nullptr)
+				sum_value += *reinterpret_cast<int*>(reply.item.value);
+
+			// dequeue()가 돌려준 value는 malloc()된 복사본
+			if (requests[i].op == GET)
+				free(reply.item.value);
 
 			// 리턴받은 key, value 값 검증
 			// ...생략...
@@ -63,17 +71,28 @@ void client_func(Queue* queue, Request requests[], int n_request) {
 	// response_time_tot += finish_time - start_time;
 }
 
-int main(void) {
+int main(int argc, char** argv) {
+	// record=[path]: capture the operation stream for hw2_replay
+	string record_path;
+	for (int i = 1; i < argc; i++) {
+		string part(argv[i]);
+		if (part.find("record=") == 0)
+			record_path = part.substr(sizeof("record"));
+	}
 	// srand((unsigned int)time(NULL));
 	srand(static_cast<unsigned>(time(nullptr)));
 
 	// 워크로드 생성(GETRANGE는 패스)
-	Request requests[REQUEST_PER_CLINET];
+	// 큐가 value_size 바이트만큼 value를 복사하므로, 값은 실제 int 페이로드로 전달
+	static int values[REQUEST_PER_CLINET / 2];
+	Request requests[REQUEST_PER_CLINET] = {};
 	for (int i = 0; i < REQUEST_PER_CLINET / 2; i++) {
 		requests[i].op = SET;
 		requests[i].item.key = i;
 		// requests[i].item.value = (void*)(rand() % 1000000);
-		requests[i].item.value = reinterpret_cast<void*>(rand() % 1000000);
+		values[i] = rand() % 1000000;
+		requests[i].item.value = &values[i];
+		requests[i].item.value_size = sizeof(values[i]);
 	}
 	for (int i = REQUEST_PER_CLINET / 2; i < REQUEST_PER_CLINET; i++) {
 		requests[i].op = GET;
@@ -82,10 +101,26 @@ int main(void) {
 	Queue* queue = init();
 	//if (queue == NULL) return 0;
 
+#if defined(CONFIG_TRACE)
+	if (!record_path.empty() && !trace_begin(record_path.c_str()))
+		cerr << "cannot record to " << record_path << endl;
+#else
+	// 큐가 CONFIG_TRACE 없이 빌드되면 기록할 연산이 없음
+	if (!record_path.empty()) {
+		cerr << "record= needs CONFIG_TRACE in qtype.h" << endl;
+		record_path.clear();
+	}
+#endif
+
 	// 일단 한 개 뿐인데, 그래도 multi client라고 가정하기
 	thread client = thread(client_func, queue, requests, REQUEST_PER_CLINET);
 	client.join();
 
+#if defined(CONFIG_TRACE)
+	if (!record_path.empty())
+		trace_end();
+#endif
+
 	release(queue);
 
 	// 의미 없는 작업
@@ -4,11 +4,16 @@
 // ==========이 파일은 수정 가능==========
 
 #include <cstddef>
+#include <cstdint>
 
 #define CONFIG_HACK y
+// #define CONFIG_TRACE y
 
 #define CONFIG_BLOCK_LEN 64
 #define CONFIG_MALLOC_ALIGNED y
+// #define CONFIG_MALLOC_ARENA y
+// #define CONFIG_ARENA_HUGETLB y
+// #define CONFIG_ARENA_POPULATE y
 
 #define CONFIG_MUTEX_USE_STL y
 // #define CONFIG_MUTEX_USE_PTHREAD y
@@ -25,12 +30,19 @@
 
 #if defined(CONFIG_ENV_64BIT)
 #define PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
 #define CACHE_SIZE 64
+#define ARENA_SIZE (1024ULL * 1024 * 1024)
 #else
 #define PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
 #define CACHE_SIZE 32
+#define ARENA_SIZE (64ULL * 1024 * 1024)
 #endif
 
+#define ARENA_CLASS_N 24
+#define ARENA_COMMIT_SIZE HUGE_PAGE_SIZE
+
 #if defined(CONFIG_ENV_WIN32)
 #define QUEUE_INLINE __forceinline
 #define QUEUE_ALIGN(alignment) __declspec(align(alignment))
@@ -72,10 +84,48 @@ typedef QUEUE_ALIGN(CACHE_SIZE) struct node_t {
     std::size_t block_idx;
 } Node;
 
+// Caller parked by dequeue_wait()/enqueue_wait() until the queue can complete its operation
+// Linked into the queue while parked, resume() is called once with the queue unlocked
+typedef struct queue_waiter_t {
+    struct queue_waiter_t* next;
+    void (*resume)(struct queue_waiter_t* waiter);
+    void* context;      // Free for the owner of resume()
+    Item item;          // enqueue_wait(): internal copy of the item while parked
+    Reply reply;        // Result, valid once resume() was called
+#if defined(CONFIG_TRACE)
+    bool is_traced;
+    std::uint16_t trace_thread; // Issuing thread, the record is written by the completing one
+    std::uint64_t trace_ns;     // Issue time, recorded when the operation completes
+#endif
+} QueueWaiter;
+
+typedef struct {
+    QueueWaiter* head, * tail;
+} QueueWaitList;
+
+#if defined(CONFIG_MALLOC_ARENA)
+// Virtual region reserved per queue and committed as it fills, served by bump allocation
+// and recycled through power-of-two size classes (CACHE_SIZE << class)
+typedef struct {
+    char* base;
+    std::size_t size;
+    std::size_t committed;
+    std::size_t used;
+    void* free_list[ARENA_CLASS_N];
+} Arena;
+#endif
+
 typedef QUEUE_ALIGN(CACHE_SIZE) struct {
     Node* head, * tail;
     Node* tree_root;
     // 필드 추가 가능
+    std::size_t size;
+    std::size_t capacity;           // 0: unbounded
+    QueueWaitList dequeue_waiters;  // Only while empty
+    QueueWaitList enqueue_waiters;  // Only while full
+#if defined(CONFIG_MALLOC_ARENA)
+    Arena arena;
+#endif
 #if defined(CONFIG_MUTEX_USE_STL)
     std::mutex mutex;
 #elif defined(CONFIG_MUTEX_USE_PTHREAD)
@@ -1,8 +1,14 @@
 #include <iostream>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
 #include "qtype.h"
 #include "queue.h"
+#include "queue_async.h"
+
+#if defined(CONFIG_TRACE)
+#include "trace.h"
+#endif
 
 #if defined(CONFIG_HACK)
 #if defined(CONFIG_ENV_WIN32)
@@ -49,6 +55,9 @@ static QUEUE_INLINE void internal_hack() {}
 
 #define INTERNAL_PREFETCH(ptr, locality) _mm_prefetch(reinterpret_cast<const char*>(ptr), (locality))
 
+// _aligned_malloc() memory cannot go to std::free(), so it is never handed to callers
+#define INTERNAL_MALLOC_IS_STD 0
+
 static QUEUE_INLINE void* internal_malloc(std::size_t size) {
     if (size >= PAGE_SIZE)
         return _aligned_malloc(__BIONIC_ALIGN(size, PAGE_SIZE), PAGE_SIZE);
@@ -64,6 +73,8 @@ static QUEUE_INLINE void internal_free(void* ptr) {
 
 #define INTERNAL_PREFETCH(ptr, locality) __builtin_prefetch((ptr), 0, (locality))
 
+#define INTERNAL_MALLOC_IS_STD 1
+
 static QUEUE_INLINE void* internal_malloc(std::size_t size) {
     void* ptr;
 
@@ -87,6 +98,8 @@ static QUEUE_INLINE void internal_free(void* ptr) {
 }
 #endif
 #else
+#define INTERNAL_MALLOC_IS_STD 1
+
 static QUEUE_INLINE void* internal_malloc(std::size_t size) {
     return std::malloc(size);
 }
@@ -96,6 +109,193 @@ static QUEUE_INLINE void internal_free(void* ptr) {
 }
 #endif
 
+#if defined(CONFIG_MALLOC_ARENA)
+#include <cstdint>
+
+// ARENA_SIZE is only reserved address space, memory is committed ARENA_COMMIT_SIZE at a time as
+// the bump pointer reaches it, so small queues (range() results) stay small
+
+#if defined(CONFIG_ENV_WIN32)
+#include <Windows.h>
+
+// CONFIG_ARENA_HUGETLB is not supported here: large pages cannot be committed into a reservation
+static bool internal_arena_map(Arena* arena) {
+    auto base = VirtualAlloc(nullptr, ARENA_SIZE, MEM_RESERVE, PAGE_READWRITE);
+
+    if (base == nullptr)
+        return false;
+
+    arena->base = reinterpret_cast<char*>(base);
+    arena->size = ARENA_SIZE;
+
+    return true;
+}
+
+static bool internal_arena_commit(Arena* arena, std::size_t size) {
+    auto ptr = arena->base + arena->committed;
+
+    if (VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE) == nullptr)
+        return false;
+
+#if defined(CONFIG_ARENA_POPULATE)
+    for (std::size_t offset = 0; offset < size; offset += PAGE_SIZE)
+        reinterpret_cast<volatile char*>(ptr)[offset] = 0;
+#endif
+
+    return true;
+}
+
+static void internal_arena_unmap(Arena* arena) {
+    VirtualFree(arena->base, 0, MEM_RELEASE);
+}
+#else
+#include <sys/mman.h>
+
+static bool internal_arena_map(Arena* arena) {
+    // Over-reserve one huge page, then trim both ends so huge pages can back the whole region
+    auto raw = mmap(nullptr, ARENA_SIZE + HUGE_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (raw == MAP_FAILED)
+        return false;
+
+    auto raw_addr = reinterpret_cast<std::uintptr_t>(raw);
+    auto addr = __BIONIC_ALIGN(raw_addr, static_cast<std::uintptr_t>(HUGE_PAGE_SIZE));
+
+    if (addr > raw_addr)
+        munmap(raw, addr - raw_addr);
+    munmap(reinterpret_cast<void*>(addr + ARENA_SIZE), HUGE_PAGE_SIZE - (addr - raw_addr));
+
+    arena->base = reinterpret_cast<char*>(addr);
+    arena->size = ARENA_SIZE;
+
+    return true;
+}
+
+static bool internal_arena_commit(Arena* arena, std::size_t size) {
+    const auto prot = PROT_READ | PROT_WRITE;
+    auto ptr = arena->base + arena->committed;
+
+#if defined(CONFIG_ARENA_HUGETLB) && defined(MAP_HUGETLB)
+    // Explicit huge pages need a reserved pool (vm.nr_hugepages); the pool is charged before
+    // the range is replaced, so a short pool fails here and leaves the reservation as it was
+#if defined(CONFIG_ARENA_POPULATE)
+    const auto hugetlb_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB | MAP_POPULATE;
+#else
+    const auto hugetlb_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB;
+#endif
+
+    if (mmap(ptr, size, prot, hugetlb_flags, -1, 0) != MAP_FAILED)
+        return true;
+#endif
+
+    if (mprotect(ptr, size, prot) == -1)
+        return false;
+
+#if defined(MADV_HUGEPAGE)
+    madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+
+#if defined(CONFIG_ARENA_POPULATE)
+#if defined(MADV_POPULATE_WRITE)
+    if (madvise(ptr, size, MADV_POPULATE_WRITE) == -1)
+#endif
+    {
+        for (std::size_t offset = 0; offset < size; offset += PAGE_SIZE)
+            reinterpret_cast<volatile char*>(ptr)[offset] = 0;
+    }
+#endif
+
+    return true;
+}
+
+static void internal_arena_unmap(Arena* arena) {
+    munmap(arena->base, arena->size);
+}
+#endif
+
+static QUEUE_INLINE std::size_t internal_arena_class(std::size_t size) {
+    std::size_t cls = 0;
+
+    while (cls < ARENA_CLASS_N && (static_cast<std::size_t>(CACHE_SIZE) << cls) < size)
+        cls++;
+
+    return cls;
+}
+
+static QUEUE_INLINE bool internal_arena_owns(const Arena* arena, const void* ptr) {
+    auto p = reinterpret_cast<const char*>(ptr);
+
+    return arena->base != nullptr && p >= arena->base && p < arena->base + arena->size;
+}
+
+// Must be called with the owning queue locked
+static QUEUE_INLINE void* internal_arena_malloc(Arena* arena, std::size_t size) {
+    auto cls = internal_arena_class(size);
+
+    if (cls >= ARENA_CLASS_N || arena->base == nullptr)
+        return internal_malloc(size);
+
+    auto ptr = arena->free_list[cls];
+
+    if (ptr != nullptr) {
+        arena->free_list[cls] = *reinterpret_cast<void**>(ptr);
+        return ptr;
+    }
+
+    auto cls_size = static_cast<std::size_t>(CACHE_SIZE) << cls;
+    auto offset = cls_size >= PAGE_SIZE ? __BIONIC_ALIGN(arena->used, static_cast<std::size_t>(PAGE_SIZE)) : arena->used;
+
+    // Arena exhausted, spill to the heap
+    if (offset + cls_size > arena->size)
+        return internal_malloc(size);
+
+    if (offset + cls_size > arena->committed) {
+        auto committed = std::min(__BIONIC_ALIGN(offset + cls_size, static_cast<std::size_t>(ARENA_COMMIT_SIZE)), arena->size);
+
+        if (!internal_arena_commit(arena, committed - arena->committed))
+            return internal_malloc(size);
+
+        arena->committed = committed;
+    }
+
+    arena->used = offset + cls_size;
+
+    return arena->base + offset;
+}
+
+// Must be called with the owning queue locked
+static QUEUE_INLINE void internal_arena_free(Arena* arena, void* ptr, std::size_t size) {
+    if (ptr == nullptr)
+        return;
+
+    if (!internal_arena_owns(arena, ptr)) {
+        internal_free(ptr);
+        return;
+    }
+
+    auto cls = internal_arena_class(size);
+
+    *reinterpret_cast<void**>(ptr) = arena->free_list[cls];
+    arena->free_list[cls] = ptr;
+}
+
+static QUEUE_INLINE void* internal_queue_malloc(Queue* queue, std::size_t size) {
+    return internal_arena_malloc(&queue->arena, size);
+}
+
+static QUEUE_INLINE void internal_queue_free(Queue* queue, void* ptr, std::size_t size) {
+    internal_arena_free(&queue->arena, ptr, size);
+}
+#else
+static QUEUE_INLINE void* internal_queue_malloc(Queue* queue, std::size_t size) {
+    return internal_malloc(size);
+}
+
+static QUEUE_INLINE void internal_queue_free(Queue* queue, void* ptr, std::size_t size) {
+    internal_free(ptr);
+}
+#endif
+
 #if defined(CONFIG_MUTEX_USE_STL)
 #include <mutex>
 
@@ -188,6 +388,47 @@ static QUEUE_INLINE void internal_lock(Queue* queue) {}
 static QUEUE_INLINE void internal_unlock(Queue* queue) {}
 #endif
 
+static QUEUE_INLINE void internal_waiter_push(QueueWaitList* list, QueueWaiter* waiter) {
+    waiter->next = nullptr;
+
+    if (list->tail == nullptr)
+        list->head = waiter;
+    else
+        list->tail->next = waiter;
+
+    list->tail = waiter;
+}
+
+static QUEUE_INLINE QueueWaiter* internal_waiter_pop(QueueWaitList* list) {
+    auto waiter = list->head;
+
+    if (waiter != nullptr) {
+        list->head = waiter->next;
+
+        if (list->head == nullptr)
+            list->tail = nullptr;
+    }
+
+    return waiter;
+}
+
+// Records a wait operation once it completes, timed from its issue
+static QUEUE_INLINE void internal_waiter_trace(QueueWaiter* waiter, bool is_enqueue) {
+#if defined(CONFIG_TRACE)
+    if (waiter->is_traced) {
+        auto& item = waiter->reply.item;
+        trace_record_for(waiter->trace_thread, is_enqueue ? TRACE_ENQUEUE_WAIT : TRACE_DEQUEUE_WAIT,
+            item.key, item.value_size, waiter->trace_ns, waiter->reply.success);
+    }
+#endif
+}
+
+// Must be called with the queue unlocked
+static QUEUE_INLINE void internal_waiter_resume(QueueWaiter* waiter, bool is_enqueue) {
+    internal_waiter_trace(waiter, is_enqueue);
+    waiter->resume(waiter);
+}
+
 static Node** find_tree_node(Queue* queue, const Item& item, bool is_overwrite = false) {
     auto node_ptr = &queue->tree_root;
 
@@ -205,7 +446,7 @@ static Node** find_tree_node(Queue* queue, const Item& item, bool is_overwrite =
         } else if (item.key > node_item.key) {
             node_ptr = &node->tree_right;
         } else if (is_overwrite) {
-            internal_free(node_item.value);
+            internal_queue_free(queue, node_item.value, node_item.value_size);
 
             // New memory was already ready, do not deep copy on here
             node_item.value = item.value;
@@ -237,6 +478,11 @@ Queue* init(void) {
 
     new (queue) Queue { nullptr, nullptr, nullptr };
 
+#if defined(CONFIG_MALLOC_ARENA)
+    // Without a reservation every allocation falls back to the heap
+    internal_arena_map(&queue->arena);
+#endif
+
 #if defined(CONFIG_MUTEX_USE_WINAPI)
     InitializeCriticalSection(&queue->mutex);
 #endif
@@ -244,14 +490,41 @@ Queue* init(void) {
     return queue;
 }
 
+Queue* init_bounded(std::size_t capacity) {
+    auto queue = init();
+
+    if (queue != nullptr)
+        queue->capacity = capacity;
+
+    return queue;
+}
+
 void release(Queue* queue) {
     if (queue == nullptr)
         return;
 
+    // Callers still parked learn that the queue is gone
+    while (auto waiter = internal_waiter_pop(&queue->dequeue_waiters)) {
+        waiter->reply = { false, { 0, nullptr } };
+        internal_waiter_resume(waiter, false);
+    }
+
+    while (auto waiter = internal_waiter_pop(&queue->enqueue_waiters)) {
+        internal_queue_free(queue, waiter->item.value, waiter->item.value_size);
+        waiter->reply = { false, { waiter->item.key, nullptr, waiter->item.value_size } };
+        internal_waiter_resume(waiter, true);
+    }
+
 #if defined(CONFIG_MUTEX_USE_WINAPI)
         DeleteCriticalSection(&queue->mutex);
 #endif
 
+#if defined(CONFIG_MALLOC_ARENA)
+    // Drops every node block and payload at once, only heap spills are left behind
+    if (queue->arena.base != nullptr)
+        internal_arena_unmap(&queue->arena);
+#endif
+
     queue->~Queue();
     internal_free(queue);
 }
@@ -286,27 +559,13 @@ Node* nclone(Node* node) {
     return new_node;
 }
 
-Reply enqueue(Queue* queue, Item item) {
-    Reply reply = { false, item };
-
-    if (queue == nullptr)
-        return reply;
-
-    item.value = internal_malloc(item.value_size);    // Only for internal use
-
-    if (item.value != nullptr && reply.item.value != nullptr)
-        std::memcpy(item.value, reply.item.value, item.value_size);
-
-    internal_lock(queue);
-
+// Must be called with the queue locked, takes over item.value (an internal copy)
+static bool internal_insert(Queue* queue, Item item) {
     auto tree_node_ptr = find_tree_node(queue, item, true);
 
-    if (tree_node_ptr == nullptr) {
-        // Existing node item has been overwritten
-        internal_unlock(queue);
-        reply.success = true;
-        return reply;
-    }
+    // Existing node item has been overwritten
+    if (tree_node_ptr == nullptr)
+        return true;
 
     auto node = queue->tail;
 
@@ -317,12 +576,11 @@ Reply enqueue(Queue* queue, Item item) {
     auto block_root =
         block_idx > 0
         ? node->block_root
-        : internal_malloc(sizeof(Node) * CONFIG_BLOCK_LEN);
+        : internal_queue_malloc(queue, sizeof(Node) * CONFIG_BLOCK_LEN);
 
     if (block_root == nullptr) {
-        internal_unlock(queue);
-        internal_free(item.value);
-        return reply;
+        internal_queue_free(queue, item.value, item.value_size);
+        return false;
     }
 
     auto new_node = &reinterpret_cast<Node*>(block_root)[block_idx];
@@ -337,15 +595,85 @@ Reply enqueue(Queue* queue, Item item) {
     }
 
     (*tree_node_ptr) = new_node;
+    queue->size++;
 
-    internal_unlock(queue);
+    return true;
+}
 
-    reply.success = true;
+// With a waiter, a full bounded queue parks it (setting is_parked) instead of failing
+static Reply internal_enqueue(Queue* queue, Item item, QueueWaiter* waiter = nullptr, bool* is_parked = nullptr) {
+    Reply reply = { false, item };
+
+    if (queue == nullptr)
+        return reply;
+
+#if !defined(CONFIG_MALLOC_ARENA)
+    item.value = internal_malloc(item.value_size);    // Only for internal use
+
+    if (item.value != nullptr && reply.item.value != nullptr)
+        std::memcpy(item.value, reply.item.value, item.value_size);
+#endif
+
+    internal_lock(queue);
+
+    // Parked dequeuers mean the queue is empty, the oldest one takes the item directly
+    auto taker = internal_waiter_pop(&queue->dequeue_waiters);
+
+    if (taker != nullptr) {
+        internal_unlock(queue);
+
+#if !defined(CONFIG_MALLOC_ARENA) && INTERNAL_MALLOC_IS_STD
+        // The copy made above is already what dequeue() would hand out
+        taker->reply = { true, item };
+#else
+#if !defined(CONFIG_MALLOC_ARENA)
+        internal_free(item.value);
+#endif
+
+        taker->reply = { true, { item.key, std::malloc(item.value_size), item.value_size } };    // Not for internal use
+
+        if (taker->reply.item.value != nullptr && reply.item.value != nullptr)
+            std::memcpy(taker->reply.item.value, reply.item.value, item.value_size);
+#endif
+
+        internal_waiter_resume(taker, false);
+
+        reply.success = true;
+        return reply;
+    }
+
+#if defined(CONFIG_MALLOC_ARENA)
+    // Arena is owned by the queue, so payloads are carved out and copied under its lock;
+    // dropping the lock around the copy would cost a second round trip per enqueue
+    item.value = internal_queue_malloc(queue, item.value_size);    // Only for internal use
+
+    if (item.value != nullptr && reply.item.value != nullptr)
+        std::memcpy(item.value, reply.item.value, item.value_size);
+#endif
+
+    // Full, unless the key is already there and only gets overwritten
+    if (queue->capacity > 0 && queue->size >= queue->capacity && *find_tree_node(queue, item) == nullptr) {
+        if (waiter != nullptr) {
+            waiter->item = item;
+            internal_waiter_push(&queue->enqueue_waiters, waiter);
+            *is_parked = true;
+        } else {
+            internal_queue_free(queue, item.value, item.value_size);
+        }
+
+        internal_unlock(queue);
+        return reply;
+    }
+
+    reply.success = internal_insert(queue, item);
+
+    internal_unlock(queue);
 
     return reply;
 }
 
-Reply dequeue(Queue* queue) {
+// With a waiter, an empty queue parks it (setting is_parked) instead of failing
+static Reply internal_dequeue(Queue* queue, QueueWaiter* waiter = nullptr, bool* is_parked = nullptr) {
     Reply reply = { false, { 0, nullptr } };
 
     if (queue == nullptr)
@@ -354,6 +682,11 @@ Reply dequeue(Queue* queue) {
     internal_lock(queue);
 
     if (queue->head == nullptr) {
+        if (waiter != nullptr) {
+            internal_waiter_push(&queue->dequeue_waiters, waiter);
+            *is_parked = true;
+        }
+
         internal_unlock(queue);
         return reply;
     }
@@ -390,22 +723,38 @@ Reply dequeue(Queue* queue) {
     if (queue->head == nullptr)
         queue->tail = nullptr;
 
-    internal_free(node->item.value);
+    internal_queue_free(queue, node->item.value, node->item.value_size);
 
     if (node->next != nullptr)
         INTERNAL_PREFETCH(node->next, 2);
 
     if (node->block_root != nullptr && (node->next == nullptr || node->next->block_root != node->block_root))
-        internal_free(node->block_root);
+        internal_queue_free(queue, node->block_root, sizeof(Node) * CONFIG_BLOCK_LEN);
+
+    queue->size--;
+
+    // Room opened up, parked enqueuers are admitted in order while it lasts
+    QueueWaitList admitted = { nullptr, nullptr };
+
+    while (queue->enqueue_waiters.head != nullptr && (queue->capacity == 0 || queue->size < queue->capacity)) {
+        auto waiter = internal_waiter_pop(&queue->enqueue_waiters);
+        auto& item = waiter->item;
+
+        waiter->reply = { internal_insert(queue, item), { item.key, nullptr, item.value_size } };
+        internal_waiter_push(&admitted, waiter);
+    }
 
     internal_unlock(queue);
 
+    while (auto waiter = internal_waiter_pop(&admitted))
+        internal_waiter_resume(waiter, true);
+
     reply.success = true;
 
     return reply;
 }
 
-Queue* range(Queue* queue, Key start, Key end) {
+static Queue* internal_range(Queue* queue, Key start, Key end) {
     if (queue == nullptr)
         return nullptr;
 
@@ -423,7 +772,7 @@ Queue* range(Queue* queue, Key start, Key end) {
         auto key = node->item.key;
 
         if (key >= start && key <= end) {
-            if (!enqueue(new_queue, node->item).success) {
+            if (!internal_enqueue(new_queue, node->item).success) {
                 internal_unlock(queue);
                 release(new_queue);
                 return nullptr;
@@ -435,3 +784,88 @@ Queue* range(Queue* queue, Key start, Key end) {
 
     return new_queue;
 }
+
+Reply enqueue(Queue* queue, Item item) {
+#if defined(CONFIG_TRACE)
+    if (trace_is_enabled()) {
+        auto start_ns = trace_now();
+        auto reply = internal_enqueue(queue, item);
+        trace_record(TRACE_ENQUEUE, item.key, item.value_size, start_ns, reply.success);
+        return reply;
+    }
+#endif
+
+    return internal_enqueue(queue, item);
+}
+
+Reply dequeue(Queue* queue) {
+#if defined(CONFIG_TRACE)
+    if (trace_is_enabled()) {
+        auto start_ns = trace_now();
+        auto reply = internal_dequeue(queue);
+        trace_record(TRACE_DEQUEUE, reply.item.key, reply.item.value_size, start_ns, reply.success);
+        return reply;
+    }
+#endif
+
+    return internal_dequeue(queue);
+}
+
+Queue* range(Queue* queue, Key start, Key end) {
+#if defined(CONFIG_TRACE)
+    if (trace_is_enabled()) {
+        auto start_ns = trace_now();
+        auto new_queue = internal_range(queue, start, end);
+        trace_record(TRACE_RANGE, start, end, start_ns, new_queue != nullptr);
+        return new_queue;
+    }
+#endif
+
+    return internal_range(queue, start, end);
+}
+
+// Wait operations are recorded once they complete, by the thread completing them,
+// under the id of the thread issuing them
+static QUEUE_INLINE void internal_waiter_begin(QueueWaiter* waiter) {
+#if defined(CONFIG_TRACE)
+    waiter->is_traced = trace_is_enabled();
+
+    if (waiter->is_traced) {
+        waiter->trace_thread = trace_thread();
+        waiter->trace_ns = trace_now();
+    }
+#endif
+}
+
+bool dequeue_wait(Queue* queue, QueueWaiter* waiter) {
+    auto is_parked = false;
+
+    internal_waiter_begin(waiter);
+
+    auto reply = internal_dequeue(queue, waiter, &is_parked);
+
+    // Once parked, the waiter may already be resumed and gone
+    if (is_parked)
+        return false;
+
+    waiter->reply = reply;
+    internal_waiter_trace(waiter, false);
+
+    return true;
+}
+
+bool enqueue_wait(Queue* queue, Item item, QueueWaiter* waiter) {
+    auto is_parked = false;
+
+    internal_waiter_begin(waiter);
+
+    auto reply = internal_enqueue(queue, item, waiter, &is_parked);
+
+    if (is_parked)
+        return false;
+
+    waiter->reply = reply;
+    internal_waiter_trace(waiter, true);
+
+    return true;
+}
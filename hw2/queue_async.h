@@ -0,0 +1,86 @@
+#ifndef _QUEUE_ASYNC_H  // header guard
+#define _QUEUE_ASYNC_H
+
+// Waiting on a Queue without a thread per waiter
+//
+// dequeue_wait() and enqueue_wait() either complete at once or park a caller-owned QueueWaiter
+// inside the queue; whoever makes room or brings an item completes it and calls its resume().
+// With C++20, async_dequeue() and async_enqueue() wrap them as awaitables that are resumed
+// through an executor: any object with a post(std::coroutine_handle<>) that resumes the handle later.
+
+#include <cstddef>
+#include "qtype.h"
+
+// enqueue() fails and enqueue_wait() parks while the queue holds capacity items
+Queue* init_bounded(std::size_t capacity);
+
+// Return true if completed right away, with the result in waiter->reply
+// Return false if parked: resume() runs exactly once later, from the thread completing the waiter
+// or from release() (reply.success=false), and the waiter must stay alive until then
+bool dequeue_wait(Queue* queue, QueueWaiter* waiter);
+bool enqueue_wait(Queue* queue, Item item, QueueWaiter* waiter);
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+
+template <typename Executor>
+class QueueAwaiter {
+public:
+    QueueAwaiter(Queue* queue_, const Item* item_, Executor& executor_):
+        queue(queue_), executor(executor_), is_enqueue(item_ != nullptr) {
+        waiter.resume = &QueueAwaiter::on_resume;
+        waiter.context = this;
+
+        if (is_enqueue)
+            item = *item_;
+    }
+
+    QueueAwaiter(const QueueAwaiter&) = delete;
+    void operator=(const QueueAwaiter&) = delete;
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    // Not suspending at all when the operation completes right away
+    bool await_suspend(std::coroutine_handle<> handle_) {
+        handle = handle_;
+
+        return is_enqueue ? !enqueue_wait(queue, item, &waiter) : !dequeue_wait(queue, &waiter);
+    }
+
+    // Like enqueue() and dequeue(): a dequeued item.value is malloc()ed and owned by the caller
+    Reply await_resume() noexcept {
+        if (is_enqueue)
+            waiter.reply.item = item;
+
+        return waiter.reply;
+    }
+
+private:
+    static void on_resume(QueueWaiter* waiter) {
+        auto self = static_cast<QueueAwaiter*>(waiter->context);
+        self->executor.post(self->handle);
+    }
+
+    Queue* queue;
+    Executor& executor;
+    bool is_enqueue;
+    Item item = { 0, nullptr, 0 };
+    QueueWaiter waiter = {};
+    std::coroutine_handle<> handle;
+};
+
+template <typename Executor>
+QueueAwaiter<Executor> async_dequeue(Queue* queue, Executor& executor) {
+    return QueueAwaiter<Executor>(queue, nullptr, executor);
+}
+
+// item.value is copied as the co_await starts, it does not have to outlive the expression
+template <typename Executor>
+QueueAwaiter<Executor> async_enqueue(Queue* queue, Item item, Executor& executor) {
+    return QueueAwaiter<Executor>(queue, &item, executor);
+}
+#endif
+
+#endif
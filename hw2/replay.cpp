@@ -0,0 +1,219 @@
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include "queue.h"
+#include "trace.h"
+
+// Replays a trace recorded with trace_begin() against a fresh queue
+// Every recorded thread gets its own replay thread, issuing its operations in the original order
+// Wait operations are skipped: they depend on the coroutine that issued them, which a trace does not hold
+
+#define TRACE_READ_LEN 4096
+
+#define MSG_HELP "usage: %s trace=[path] speed=[ratio, 0 for max speed]\n"
+
+static const char* const OP_NAMES[] = { "enqueue", "dequeue", "range" };
+
+typedef struct {
+    std::vector<TraceRecord> records;
+    std::vector<std::uint64_t> latency_ns[3];
+} ReplayThread;
+
+static std::uint64_t percentile(const std::vector<std::uint64_t>& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+
+    return sorted[std::min(sorted.size() - 1, static_cast<std::size_t>(p * sorted.size()))];
+}
+
+static void print_latency(const char* name, std::vector<std::uint64_t>& latency_ns) {
+    if (latency_ns.empty())
+        return;
+
+    std::sort(latency_ns.begin(), latency_ns.end());
+
+    std::printf("%-8s n=%-10zu p50=%-8llu p90=%-8llu p99=%-8llu p999=%-8llu max=%llu (ns)\n",
+        name, latency_ns.size(),
+        static_cast<unsigned long long>(percentile(latency_ns, 0.50)),
+        static_cast<unsigned long long>(percentile(latency_ns, 0.90)),
+        static_cast<unsigned long long>(percentile(latency_ns, 0.99)),
+        static_cast<unsigned long long>(percentile(latency_ns, 0.999)),
+        static_cast<unsigned long long>(latency_ns.back()));
+}
+
+static void replay_task(Queue* queue, ReplayThread& th, char* payload, double speed,
+                       const std::atomic<bool>& is_start, const std::chrono::steady_clock::time_point& start_time) {
+    while (!is_start.load(std::memory_order_acquire))
+        std::this_thread::yield();
+
+    for (auto& record : th.records) {
+        auto op_start = std::chrono::steady_clock::now();
+
+        // Latency counts from the scheduled time, so falling behind shows up as queueing delay
+        if (speed > 0) {
+            auto due = start_time + std::chrono::nanoseconds(static_cast<long long>(record.time_ns / speed));
+
+            std::this_thread::sleep_until(due);
+            op_start = due;
+        }
+
+        switch (record.op) {
+        case TRACE_ENQUEUE: {
+            Item item = { record.key, payload, static_cast<int>(record.arg) };
+            enqueue(queue, item);
+            break;
+        }
+
+        case TRACE_DEQUEUE: {
+            auto reply = dequeue(queue);
+
+            if (reply.success)
+                std::free(reply.item.value);
+            break;
+        }
+
+        case TRACE_RANGE:
+            release(range(queue, record.key, record.arg));
+            break;
+
+        default:
+            continue;
+        }
+
+        auto op_end = std::chrono::steady_clock::now();
+        th.latency_ns[record.op].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(op_end - op_start).count());
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string path;
+    double speed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        std::string part(argv[i]);
+
+        if (part.find("trace=") == 0)
+            path = part.substr(sizeof("trace"));
+        else if (part.find("speed=") == 0)
+            speed = std::strtod(part.substr(sizeof("speed")).c_str(), nullptr);
+    }
+
+    if (path.empty() || speed < 0) {
+        std::printf(MSG_HELP, argc > 0 ? argv[0] : "");
+        std::exit(1);
+    }
+
+    TraceReader reader;
+
+    if (!trace_open(path.c_str(), reader)) {
+        std::fprintf(stderr, "%s: not a valid trace\n", path.c_str());
+        std::exit(1);
+    }
+
+    std::vector<ReplayThread> threads(std::max<std::uint32_t>(reader.header.thread_n, 1));
+    std::vector<std::size_t> record_n(threads.size(), 0);
+    std::vector<TraceRecord> chunk(TRACE_READ_LEN);
+    std::uint64_t total_n = 0;
+    std::uint64_t wait_n = 0;
+    std::uint32_t payload_size = 0;
+
+    auto is_valid = [&threads](const TraceRecord& record) {
+        return record.thread < threads.size() && record.op <= TRACE_RANGE;
+    };
+
+    auto is_wait = [](const TraceRecord& record) {
+        return record.op == TRACE_ENQUEUE_WAIT || record.op == TRACE_DEQUEUE_WAIT;
+    };
+
+    // Two passes over the file: size every thread's records exactly, then fill them in
+    while (auto chunk_n = trace_read(reader, chunk.data(), chunk.size())) {
+        total_n += chunk_n;
+
+        for (std::size_t i = 0; i < chunk_n; i++) {
+            if (is_wait(chunk[i]))
+                wait_n++;
+
+            if (!is_valid(chunk[i]))
+                continue;
+
+            record_n[chunk[i].thread]++;
+
+            if (chunk[i].op == TRACE_ENQUEUE)
+                payload_size = std::max(payload_size, chunk[i].arg);
+        }
+    }
+
+    if (total_n != reader.header.record_n || !trace_rewind(reader)) {
+        std::fprintf(stderr, "%s: not a valid trace\n", path.c_str());
+        std::exit(1);
+    }
+
+    for (std::size_t i = 0; i < threads.size(); i++)
+        threads[i].records.reserve(record_n[i]);
+
+    while (auto chunk_n = trace_read(reader, chunk.data(), chunk.size())) {
+        for (std::size_t i = 0; i < chunk_n; i++) {
+            if (is_valid(chunk[i]))
+                threads[chunk[i].thread].records.push_back(chunk[i]);
+        }
+    }
+
+    trace_close(reader);
+
+    std::vector<char> payload(payload_size, 0x5a);
+
+    auto queue = init();
+
+    if (queue == nullptr) {
+        std::fprintf(stderr, "queue init failed\n");
+        std::exit(1);
+    }
+
+    std::atomic<bool> is_start(false);
+    std::chrono::steady_clock::time_point start_time;
+    std::vector<std::thread> th_vec;
+
+    for (auto& th : threads)
+        th_vec.emplace_back(replay_task, queue, std::ref(th), payload.data(), speed, std::cref(is_start), std::cref(start_time));
+
+    start_time = std::chrono::steady_clock::now();
+    is_start.store(true, std::memory_order_release);
+
+    for (auto& th : th_vec)
+        th.join();
+
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+    release(queue);
+
+    std::vector<std::uint64_t> total_ns;
+    std::size_t op_n = 0;
+
+    std::printf("trace: %llu ops, %zu threads, speed %s\n", static_cast<unsigned long long>(total_n), threads.size(), speed > 0 ? std::to_string(speed).c_str() : "max");
+
+    if (wait_n > 0)
+        std::printf("skipped %llu wait ops\n", static_cast<unsigned long long>(wait_n));
+
+    for (int op = TRACE_ENQUEUE; op <= TRACE_RANGE; op++) {
+        std::vector<std::uint64_t> latency_ns;
+
+        for (auto& th : threads)
+            latency_ns.insert(latency_ns.end(), th.latency_ns[op].begin(), th.latency_ns[op].end());
+
+        total_ns.insert(total_ns.end(), latency_ns.begin(), latency_ns.end());
+        op_n += latency_ns.size();
+
+        print_latency(OP_NAMES[op], latency_ns);
+    }
+
+    print_latency("total", total_ns);
+
+    std::printf("elapsed %.6f s, throughput %.0f ops/s\n", elapsed, elapsed > 0 ? op_n / elapsed : 0.0);
+
+    return 0;
+}
@@ -0,0 +1,210 @@
+#include <cstdio>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <vector>
+#include "trace.h"
+
+#define TRACE_BUFFER_LEN 4096
+
+// Records are staged per thread and written in chunks, so recording threads
+// only meet on the file lock once every TRACE_BUFFER_LEN operations
+
+typedef struct {
+    std::uint64_t session;
+    std::uint16_t thread;
+    std::size_t len;
+    TraceRecord records[TRACE_BUFFER_LEN];
+} TraceBuffer;
+
+std::atomic<bool> trace_enabled(false);
+
+static std::mutex trace_mutex;
+static std::FILE* trace_file = nullptr;
+static std::chrono::steady_clock::time_point trace_epoch;
+static std::atomic<std::uint64_t> trace_session(0);
+static std::uint32_t trace_thread_n = 0;
+static std::uint64_t trace_record_n = 0;
+static std::vector<TraceBuffer*> trace_buffers;
+
+// Must be called with trace_mutex locked
+static void internal_trace_flush(TraceBuffer* buf) {
+    if (trace_file != nullptr && buf->session == trace_session.load(std::memory_order_relaxed) && buf->len > 0) {
+        std::fwrite(buf->records, sizeof(TraceRecord), buf->len, trace_file);
+        trace_record_n += buf->len;
+    }
+
+    buf->len = 0;
+}
+
+static void internal_trace_release(TraceBuffer* buf) {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+
+    internal_trace_flush(buf);
+    trace_buffers.erase(std::remove(trace_buffers.begin(), trace_buffers.end(), buf), trace_buffers.end());
+
+    delete buf;
+}
+
+static TraceBuffer* internal_trace_buffer() {
+    struct Holder {
+        TraceBuffer* buf = nullptr;
+
+        ~Holder() {
+            if (buf != nullptr)
+                internal_trace_release(buf);
+        }
+    };
+
+    thread_local Holder holder;
+    auto session = trace_session.load(std::memory_order_relaxed);
+
+    if (holder.buf != nullptr && holder.buf->session == session)
+        return holder.buf;
+
+    std::lock_guard<std::mutex> lock(trace_mutex);
+
+    if (holder.buf == nullptr) {
+        holder.buf = new TraceBuffer;
+        trace_buffers.push_back(holder.buf);
+    }
+
+    holder.buf->session = session;
+    holder.buf->thread = static_cast<std::uint16_t>(trace_thread_n++);
+    holder.buf->len = 0;
+
+    return holder.buf;
+}
+
+bool trace_begin(const char* path) {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+
+    if (trace_file != nullptr)
+        return false;
+
+    trace_file = std::fopen(path, "wb");
+
+    if (trace_file == nullptr)
+        return false;
+
+    // Patched with the final counts by trace_end()
+    TraceHeader header = { TRACE_MAGIC, TRACE_VERSION, 0, sizeof(TraceRecord), 0 };
+    std::fwrite(&header, sizeof(header), 1, trace_file);
+
+    trace_session.fetch_add(1, std::memory_order_relaxed);
+    trace_thread_n = 0;
+    trace_record_n = 0;
+    trace_epoch = std::chrono::steady_clock::now();
+
+    trace_enabled.store(true, std::memory_order_release);
+
+    return true;
+}
+
+void trace_end(void) {
+    trace_enabled.store(false, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(trace_mutex);
+
+    if (trace_file == nullptr)
+        return;
+
+    for (auto buf : trace_buffers)
+        internal_trace_flush(buf);
+
+    TraceHeader header = { TRACE_MAGIC, TRACE_VERSION, trace_thread_n, sizeof(TraceRecord), trace_record_n };
+    std::fseek(trace_file, 0, SEEK_SET);
+    std::fwrite(&header, sizeof(header), 1, trace_file);
+
+    std::fclose(trace_file);
+    trace_file = nullptr;
+
+    // Stale thread buffers rejoin with fresh ids on the next session
+    trace_session.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::uint64_t trace_now(void) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - trace_epoch).count();
+}
+
+static void internal_trace_push(TraceBuffer* buf, std::uint16_t thread, TraceOp op, std::uint32_t key, std::uint32_t arg, std::uint64_t start_ns, bool success) {
+    auto latency_ns = trace_now() - start_ns;
+
+    if (buf->len == TRACE_BUFFER_LEN) {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        internal_trace_flush(buf);
+    }
+
+    auto& record = buf->records[buf->len++];
+
+    record.time_ns = start_ns;
+    record.key = key;
+    record.arg = arg;
+    record.latency_ns = static_cast<std::uint32_t>(std::min<std::uint64_t>(latency_ns, UINT32_MAX));
+    record.thread = thread;
+    record.op = static_cast<std::uint8_t>(op);
+    record.success = success;
+}
+
+void trace_record(TraceOp op, std::uint32_t key, std::uint32_t arg, std::uint64_t start_ns, bool success) {
+    auto buf = internal_trace_buffer();
+    internal_trace_push(buf, buf->thread, op, key, arg, start_ns, success);
+}
+
+std::uint16_t trace_thread(void) {
+    return internal_trace_buffer()->thread;
+}
+
+void trace_record_for(std::uint16_t thread, TraceOp op, std::uint32_t key, std::uint32_t arg, std::uint64_t start_ns, bool success) {
+    internal_trace_push(internal_trace_buffer(), thread, op, key, arg, start_ns, success);
+}
+
+bool trace_open(const char* path, TraceReader& reader) {
+    reader.file = std::fopen(path, "rb");
+
+    if (reader.file == nullptr)
+        return false;
+
+    auto& header = reader.header;
+
+    auto is_ok = std::fread(&header, sizeof(header), 1, reader.file) == 1
+        && header.magic == TRACE_MAGIC
+        && header.version == TRACE_VERSION
+        && header.record_size == sizeof(TraceRecord);
+
+    if (!is_ok) {
+        trace_close(reader);
+        return false;
+    }
+
+    reader.left_n = header.record_n;
+
+    return true;
+}
+
+std::size_t trace_read(TraceReader& reader, TraceRecord* records, std::size_t len) {
+    if (reader.file == nullptr)
+        return 0;
+
+    auto read_n = std::fread(records, sizeof(TraceRecord), std::min<std::uint64_t>(len, reader.left_n), reader.file);
+    reader.left_n -= read_n;
+
+    return read_n;
+}
+
+bool trace_rewind(TraceReader& reader) {
+    if (reader.file == nullptr || std::fseek(reader.file, sizeof(TraceHeader), SEEK_SET) != 0)
+        return false;
+
+    reader.left_n = reader.header.record_n;
+
+    return true;
+}
+
+void trace_close(TraceReader& reader) {
+    if (reader.file != nullptr)
+        std::fclose(reader.file);
+
+    reader.file = nullptr;
+}
@@ -0,0 +1,77 @@
+#ifndef _TRACE_H  // header guard
+#define _TRACE_H
+
+// Operation stream recording for reproducible queue benchmarks
+//
+// File layout: TraceHeader, then TraceRecord * record_n
+// Records of one thread keep their issue order, records of different threads may interleave
+// Wait records are the exception: they are written by the thread completing the operation,
+// carry the id of the thread that issued it and may land out of order, sort them by time_ns
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <atomic>
+#include "qtype.h"
+
+#define TRACE_MAGIC 0x43525451u  // "QTRC"
+#define TRACE_VERSION 2
+
+typedef enum {
+    TRACE_ENQUEUE,
+    TRACE_DEQUEUE,
+    TRACE_RANGE,
+    TRACE_ENQUEUE_WAIT,     // enqueue_wait(), recorded on completion
+    TRACE_DEQUEUE_WAIT      // dequeue_wait(), recorded on completion
+} TraceOp;
+
+typedef struct {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t thread_n;
+    std::uint32_t record_size;
+    std::uint64_t record_n;
+} TraceHeader;
+
+typedef struct {
+    std::uint64_t time_ns;      // Issue time, relative to trace_begin()
+    std::uint32_t key;          // TRACE_RANGE: start
+    std::uint32_t arg;          // TRACE_ENQUEUE: value_size, TRACE_RANGE: end
+    std::uint32_t latency_ns;   // Saturated at UINT32_MAX
+    std::uint16_t thread;       // Dense id in order of first recorded operation
+    std::uint8_t op;
+    std::uint8_t success;
+} TraceRecord;
+
+extern std::atomic<bool> trace_enabled;
+
+// Operations are recorded only between these calls
+// trace_end() must not race with queue operations still in flight
+bool trace_begin(const char* path);
+void trace_end(void);
+
+static inline bool trace_is_enabled(void) {
+    return trace_enabled.load(std::memory_order_acquire);
+}
+
+std::uint64_t trace_now(void);
+void trace_record(TraceOp op, std::uint32_t key, std::uint32_t arg, std::uint64_t start_ns, bool success);
+
+// Id of the calling thread in the current trace, for operations completed by another thread
+std::uint16_t trace_thread(void);
+void trace_record_for(std::uint16_t thread, TraceOp op, std::uint32_t key, std::uint32_t arg, std::uint64_t start_ns, bool success);
+
+typedef struct {
+    std::FILE* file;
+    TraceHeader header;
+    std::uint64_t left_n;   // Records not read yet
+} TraceReader;
+
+// Traces are read back in chunks, so a reader never holds more than it asks for
+// trace_read() returns fewer than len records only at the end of the trace or on a short file
+bool trace_open(const char* path, TraceReader& reader);
+std::size_t trace_read(TraceReader& reader, TraceRecord* records, std::size_t len);
+bool trace_rewind(TraceReader& reader);
+void trace_close(TraceReader& reader);
+
+#endif